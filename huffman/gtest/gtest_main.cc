@@ -30,16 +30,18 @@
 #include <stdio.h>
 
 #include <gtest/gtest.h>
+#ifdef _MSC_VER
 #define _CRTDBG_MAP_ALLOC
 #include <stdlib.h>
 #include <crtdbg.h>
+#endif
 
 
 GTEST_API_ int main(int argc, char **argv) {
   printf("Running main() from gtest_main.cc\n");
   testing::InitGoogleTest(&argc, argv);
+#ifdef _MSC_VER
   _CrtSetDbgFlag(_CrtSetDbgFlag(_CRTDBG_REPORT_FLAG) | _CRTDBG_LEAK_CHECK_DF);
-  RUN_ALL_TESTS();
-  system("pause");
-  return 0;
+#endif
+  return RUN_ALL_TESTS();
 }
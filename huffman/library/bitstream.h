@@ -0,0 +1,144 @@
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+
+#include <cstddef>
+#include <cstdint>
+
+namespace huffman
+{
+	typedef unsigned char byte;
+
+	// MSB-first bit writer: codes are shifted into a 64-bit accumulator,
+	// every full 32-bit word goes straight to the output
+	class bit_writer
+	{
+	public:
+		void reset(byte* output) // continue the stream at output
+		{
+			out_ = output;
+		}
+
+		byte* position() const
+		{
+			return out_;
+		}
+
+		size_t pending() const // bits not written yet
+		{
+			return cnt_;
+		}
+
+		// bytes a stream of codes of at most max_length bits can take,
+		// pending bits and the padded last byte fit in two more words
+		static size_t max_size(size_t codes, size_t max_length)
+		{
+			return (codes * max_length + 2 * 32) / 8;
+		}
+
+		void put(uint64_t code, size_t length) // code has no bits above length
+		{
+			if (length > 32)
+			{
+				put(code >> 32, length - 32);
+				code &= 0xffffffff;
+				length = 32;
+			}
+			acc_ = (acc_ << length) | code;
+			cnt_ += length;
+			if (cnt_ >= 32)
+			{
+				cnt_ -= 32;
+				const uint32_t word = static_cast<uint32_t>(acc_ >> cnt_);
+				out_[0] = static_cast<byte>(word >> 24);
+				out_[1] = static_cast<byte>(word >> 16);
+				out_[2] = static_cast<byte>(word >> 8);
+				out_[3] = static_cast<byte>(word);
+				out_ += 4;
+			}
+		}
+
+		void flush() // write pending bits, the last byte is padded with zeros
+		{
+			while (cnt_ >= 8)
+			{
+				cnt_ -= 8;
+				*out_++ = static_cast<byte>(acc_ >> cnt_);
+			}
+			if (cnt_ > 0)
+				*out_++ = static_cast<byte>(acc_ << (8 - cnt_));
+			acc_ = 0;
+			cnt_ = 0;
+		}
+
+	private:
+		uint64_t acc_ = 0;
+		size_t cnt_ = 0; // pending bits, always < 32 between calls
+		byte* out_ = nullptr;
+	};
+
+	// MSB-first bit reader over a whole stream written by bit_writer,
+	// bits past the end read as zeros
+	class bit_reader
+	{
+	public:
+		void reset(const byte* input, size_t size)
+		{
+			next_ = input;
+			end_ = input + size;
+			bits_ = 0;
+			cnt_ = 0;
+		}
+
+		void refill() // at least 56 bits afterwards unless the input ends
+		{
+			if (end_ - next_ >= 8)
+			{
+				// one load tops the buffer up to 56-63 bits; the bits it holds past cnt_
+				// are the next ones of the stream, so loading them again changes nothing
+				bits_ |= load_be64(next_) >> cnt_;
+				next_ += (63 - cnt_) >> 3;
+				cnt_ |= 56;
+				return;
+			}
+			while (cnt_ <= 56 && next_ != end_) // the last bytes one at a time
+			{
+				bits_ |= static_cast<uint64_t>(*next_++) << (56 - cnt_);
+				cnt_ += 8;
+			}
+		}
+
+		uint64_t peek() const // unread bits aligned to the most significant bit
+		{
+			return bits_;
+		}
+
+		size_t count() const
+		{
+			return cnt_;
+		}
+
+		void consume(size_t length) // length < 64 and <= count()
+		{
+			bits_ <<= length;
+			cnt_ -= length;
+		}
+
+	private:
+		static uint64_t load_be64(const byte* x) // unaligned, compilers make it one load and a swap
+		{
+			return static_cast<uint64_t>(x[0]) << 56 | static_cast<uint64_t>(x[1]) << 48
+				| static_cast<uint64_t>(x[2]) << 40 | static_cast<uint64_t>(x[3]) << 32
+				| static_cast<uint64_t>(x[4]) << 24 | static_cast<uint64_t>(x[5]) << 16
+				| static_cast<uint64_t>(x[6]) << 8 | static_cast<uint64_t>(x[7]);
+		}
+
+		const byte* next_ = nullptr;
+		const byte* end_ = nullptr;
+		uint64_t bits_ = 0;
+		size_t cnt_ = 0;
+	};
+}
+
+
+#endif
@@ -0,0 +1,78 @@
+#include "crc32c.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HUFFMAN_CRC32C_SSE42
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define HUFFMAN_TARGET_SSE42
+#else
+#define HUFFMAN_TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+#endif
+
+namespace huffman
+{
+	const uint32_t CRC32C_POLY = 0x82f63b78; // reflected
+
+	uint32_t crc32c_portable(const byte* data, size_t size, uint32_t crc)
+	{
+		static const struct table
+		{
+			uint32_t x[256];
+			table()
+			{
+				for (uint32_t i = 0; i < 256; ++i)
+				{
+					uint32_t c = i;
+					for (int bit = 0; bit < 8; ++bit)
+						c = (c >> 1) ^ (c & 1 ? CRC32C_POLY : 0);
+					x[i] = c;
+				}
+			}
+		} crc_table;
+		crc = ~crc;
+		for (size_t i = 0; i < size; ++i)
+			crc = (crc >> 8) ^ crc_table.x[(crc ^ data[i]) & 0xff];
+		return ~crc;
+	}
+
+#ifdef HUFFMAN_CRC32C_SSE42
+	static bool has_sse42()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 20)) != 0;
+#else
+		return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+	}
+
+	HUFFMAN_TARGET_SSE42 static uint32_t crc32c_sse42(const byte* data, size_t size, uint32_t crc)
+	{
+		uint64_t c = ~crc;
+		for (; size >= 8; size -= 8, data += 8)
+		{
+			uint64_t word;
+			memcpy(&word, data, 8);
+			c = _mm_crc32_u64(c, word);
+		}
+		crc = static_cast<uint32_t>(c);
+		for (; size > 0; --size)
+			crc = _mm_crc32_u8(crc, *data++);
+		return ~crc;
+	}
+#endif
+
+	uint32_t crc32c(const byte* data, const size_t size, const uint32_t crc)
+	{
+#ifdef HUFFMAN_CRC32C_SSE42
+		static const bool sse42 = has_sse42();
+		if (sse42)
+			return crc32c_sse42(data, size, crc);
+#endif
+		return crc32c_portable(data, size, crc);
+	}
+}
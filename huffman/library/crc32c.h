@@ -0,0 +1,20 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+
+#include <cstddef>
+#include <cstdint>
+
+namespace huffman
+{
+	typedef unsigned char byte;
+
+	// CRC32C (Castagnoli); pass an earlier result as crc to continue it.
+	// Uses the SSE4.2 crc32 instruction when the CPU has it
+	uint32_t crc32c(const byte* data, size_t size, uint32_t crc = 0);
+	// the same value without SSE4.2
+	uint32_t crc32c_portable(const byte* data, size_t size, uint32_t crc = 0);
+}
+
+
+#endif
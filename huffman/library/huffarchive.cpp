@@ -0,0 +1,951 @@
+#include "huffarchive.h"
+#include "crc32c.h"
+#include "huffexception.h"
+#include "mapped_file.h"
+#include "ring_buffer.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+
+namespace huffman
+{
+	void write_block_header(byte* x, const block_header& header, size_t& end, const byte version)
+	{
+		x[end++] = static_cast<byte>(header.type);
+		for (const uint64_t size : {header.raw_size, header.table_size, header.payload_size})
+		{
+			if (version == 1)
+				write_le64(x, size, end);
+			else
+				write_varint(x, size, end);
+		}
+	}
+
+	block_header read_block_header(const byte* x, const size_t size, size_t& end, const byte version)
+	{
+		if (end >= size || x[end] > STORED_BLOCK) // no such type
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		block_header header;
+		header.type = static_cast<block_type>(x[end++]);
+		for (uint64_t* field : {&header.raw_size, &header.table_size, &header.payload_size})
+		{
+			if (version == 1 && size - end >= 8)
+				*field = read_le64(x, end);
+			else if (version == 1 || !read_varint(x, size, end, *field))
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		}
+		return header;
+	}
+
+	/************************ blocks: **************************************/
+
+	static uint32_t block_checksum(const block_header& header, const byte* packed, const byte version)
+	{
+		byte x[MAX_BLOCK_HEADER_SIZE];
+		size_t end = 0;
+		write_block_header(x, header, end, version);
+		return crc32c(packed, header.packed_size(), crc32c(x, end));
+	}
+
+	// coding pays if it saves a STORED_GAIN-th of the block at least
+	static bool worth_coding(const size_t size, const uint64_t packed_bits)
+	{
+		return packed_bits / CHAR_BIT + size / STORED_GAIN < size;
+	}
+
+	uint64_t encode_block(const byte* input, const size_t size, vector<byte>& output, const archive_options& options)
+	{
+		block_header header;
+		header.raw_size = size;
+		header.type = STORED_BLOCK;
+		vector<byte> table, payload;
+		uint64_t limit_loss = 0;
+		if (options.context)
+		{
+			ContextEncoder encoder(options.max_code_length);
+			encoder.append(input, size);
+			encoder.append(input, 0);
+			encoder.write_tables(table);
+			if (worth_coding(size, table.size() * CHAR_BIT + encoder.payload_bits()))
+			{
+				encoder.encode(input, size, payload);
+				header.type = CONTEXT_BLOCK;
+				limit_loss = encoder.limit_loss();
+			}
+		}
+		else
+		{
+			HuffmanEncoder encoder(CANONICAL_CODES, options.max_code_length);
+			encoder.append(input, size);
+			encoder.append(input, 0);
+			table.resize(encoder.header_size());
+			encoder.write_header(table.data(), table.size());
+			const size_t jump_table = options.interleaved ? JUMP_TABLE_SIZE : 0;
+			if (worth_coding(size, (table.size() + jump_table) * CHAR_BIT + encoder.payload_bits()))
+			{
+				if (options.interleaved)
+					encoder.encode_interleaved(input, size, payload);
+				else
+				{
+					payload.resize(encoder.max_encoded_size(size) + encoder.max_encoded_size(0));
+					size_t end = encoder.encode(input, size, payload.data(), payload.size());
+					end += encoder.encode(input, 0, payload.data() + end, payload.size() - end);
+					payload.resize(end);
+				}
+				header.type = options.interleaved ? HUFFMAN4_BLOCK : HUFFMAN_BLOCK;
+				limit_loss = encoder.limit_loss();
+			}
+		}
+		if (header.type == STORED_BLOCK)
+			table.clear();
+
+		header.table_size = table.size();
+		header.payload_size = header.type == STORED_BLOCK ? size : payload.size();
+		size_t end = output.size();
+		output.resize(end + MAX_BLOCK_HEADER_SIZE);
+		write_block_header(output.data(), header, end);
+		output.resize(end + (options.checksums ? CHECKSUM_SIZE : 0));
+		const size_t checksum = end;
+		output.insert(output.end(), table.begin(), table.end());
+		if (header.type == STORED_BLOCK)
+			output.insert(output.end(), input, input + size);
+		output.insert(output.end(), payload.begin(), payload.end());
+		if (options.checksums)
+		{
+			const uint32_t crc = block_checksum(header, output.data() + checksum + CHECKSUM_SIZE, ARCHIVE_VERSION);
+			for (size_t i = 0; i < CHECKSUM_SIZE; ++i)
+				output[checksum + i] = static_cast<byte>(crc >> (8 * i));
+		}
+		return limit_loss;
+	}
+
+	void decode_block(const block_header& header, const byte* packed, byte* output)
+	{
+		if (header.type == STORED_BLOCK)
+		{
+			if (header.table_size != 0 || header.payload_size != header.raw_size)
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+			memcpy(output, packed, header.raw_size);
+			return;
+		}
+		if (header.type == CONTEXT_BLOCK)
+		{
+			ContextDecoder decoder;
+			if (!decoder.read_tables(packed, header.table_size)
+				|| !decoder.decode(packed + header.table_size, header.payload_size, output, header.raw_size))
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+			return;
+		}
+		size_t end = 0;
+		if ((header.type != HUFFMAN_BLOCK && header.type != HUFFMAN4_BLOCK) || header.table_size != 4 + ALPHABET
+			|| read_int_from_byte_array(packed, header.table_size, end) != CANONICAL_TAG
+			|| !valid_code_lengths(packed + end))
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+
+		HuffmanDecoder decoder;
+		decoder.append(packed, header.table_size);
+		decoder.append(packed, 0);
+		if (header.type == HUFFMAN4_BLOCK)
+		{
+			if (!decoder.decode_interleaved(packed + header.table_size, header.payload_size, output, header.raw_size))
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+			return;
+		}
+		if (decoder.decode(packed + header.table_size, header.payload_size, output, header.raw_size) != header.raw_size)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+	}
+
+	/************************ format: **************************************/
+
+	// what the archive header tells about the blocks
+	struct archive_format
+	{
+		byte version;
+		uint64_t block_size;
+		size_t checksum_size; // 0 without CHECKSUM_FLAG
+	};
+
+	const size_t V1_INDEX_ENTRY_SIZE = 2 * 8;
+
+	// throws if the header is not a supported archive header
+	static archive_format read_archive_header(const byte* header)
+	{
+		archive_format format;
+		size_t end = MAGIC_SIZE;
+		format.version = header[end++];
+		const byte flags = header[end++];
+		format.block_size = read_le64(header, end);
+		format.checksum_size = flags & CHECKSUM_FLAG ? CHECKSUM_SIZE : 0;
+		if (memcmp(header, ARCHIVE_MAGIC, MAGIC_SIZE) != 0 || format.version == 0 || format.version > ARCHIVE_VERSION
+			|| (flags & ~CHECKSUM_FLAG) != 0 || format.block_size > MAX_BLOCK_SIZE)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		return format;
+	}
+
+	static void read_exactly(std::istream& in, byte* x, const size_t size)
+	{
+		in.read(reinterpret_cast<char*>(x), size);
+		if (static_cast<size_t>(in.gcount()) != size)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+	}
+
+	// x grows a BLOCK_SIZE at a time as the bytes arrive, so a block header
+	// that claims more than the archive holds cannot make it allocate the claim
+	static void read_exactly(std::istream& in, vector<byte>& x, const uint64_t size)
+	{
+		x.clear();
+		while (x.size() < size)
+		{
+			const size_t begin = x.size();
+			x.resize(begin + std::min<uint64_t>(size - begin, BLOCK_SIZE));
+			read_exactly(in, x.data() + begin, x.size() - begin);
+		}
+	}
+
+	static uint32_t read_checksum(const byte* x)
+	{
+		uint32_t crc = 0;
+		for (size_t i = 0; i < CHECKSUM_SIZE; ++i)
+			crc |= static_cast<uint32_t>(x[i]) << (8 * i);
+		return crc;
+	}
+
+	// the next block header and its checksum (0 without one), false at END_BLOCK;
+	// offset is moved past the bytes read
+	static bool read_block_header(std::istream& in, const archive_format& format, block_header& block, uint32_t& checksum,
+	                              uint64_t& offset)
+	{
+		byte x[MAX_BLOCK_HEADER_SIZE + CHECKSUM_SIZE];
+		read_exactly(in, x, 1);
+		++offset;
+		if (x[0] == END_BLOCK)
+			return false;
+		size_t size = 1;
+		if (format.version == 1)
+		{
+			read_exactly(in, x + size, 3 * 8);
+			size += 3 * 8;
+		}
+		else // a varint ends at a byte without the top bit
+		{
+			for (size_t fields = 0; fields < 3 && size < MAX_BLOCK_HEADER_SIZE; ++size)
+			{
+				read_exactly(in, x + size, 1);
+				if ((x[size] & 0x80) == 0)
+					++fields;
+			}
+		}
+		size_t end = 0;
+		block = read_block_header(x, size, end, format.version);
+		read_exactly(in, x + end, format.checksum_size);
+		checksum = format.checksum_size != 0 ? read_checksum(x + end) : 0;
+		offset += end - 1 + format.checksum_size;
+		return true;
+	}
+
+	static void check_block_header(const block_header& block, const uint64_t block_size)
+	{
+		// codes take 1 to MAX_CODE_LENGTH bits, interleaved payloads add a jump table and padding;
+		// the longest payload is compared by dividing, raw_size * MAX_CODE_LENGTH could wrap
+		const uint64_t slack = JUMP_TABLE_SIZE + STREAMS * 8;
+		if (block.type == END_BLOCK || block.raw_size > block_size || block.table_size > MAX_CONTEXT_TABLES_SIZE
+			|| (block.payload_size > slack && (block.payload_size - slack - 1) / (MAX_CODE_LENGTH / CHAR_BIT) >= block.raw_size)
+			|| (block.type != STORED_BLOCK && block.raw_size > block.payload_size * CHAR_BIT))
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+	}
+
+	/************************ index: **************************************/
+
+	// index holds the size bytes from END_BLOCK to the trailer
+	static vector<block_info> parse_index(const byte* index, const uint64_t size, const uint64_t index_offset, const byte version)
+	{
+		if (index[0] != END_BLOCK)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		size_t end = 1;
+		uint64_t count;
+		if (version == 1)
+		{
+			if (size < 1 + 8 || (count = read_le64(index, end)) != (size - 1 - 8) / V1_INDEX_ENTRY_SIZE)
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		}
+		else if (!read_varint(index, size, end, count) || count > (size - end) / 2) // two bytes per block at least
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		vector<block_info> blocks(count);
+		uint64_t offset = ARCHIVE_HEADER_SIZE;
+		for (size_t i = 0; i < blocks.size(); ++i)
+		{
+			block_info& info = blocks[i];
+			uint64_t packed;
+			if (version == 1) // offsets follow the blocks, the next one or the index ends this block
+			{
+				info.offset = read_le64(index, end);
+				info.raw_size = read_le64(index, end);
+				size_t next_end = end;
+				const uint64_t next = i + 1 < blocks.size() ? read_le64(index, next_end) : index_offset;
+				if (info.offset != offset || next <= offset)
+					throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+				packed = next - offset;
+			}
+			else if (!read_varint(index, size, end, packed) || !read_varint(index, size, end, info.raw_size))
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+			// a block decodes to at most CHAR_BIT bytes per packed byte, so the output
+			// a mapped decode creates up front is bounded by the archive size
+			if (packed > index_offset - offset || info.raw_size > packed * CHAR_BIT)
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+			info.offset = offset;
+			offset += packed;
+		}
+		if ((version != 1 && end != size) || offset != index_offset)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		return blocks;
+	}
+
+	// offset of the index, checked against the size of the archive
+	static uint64_t read_trailer(const byte* trailer, const uint64_t file_size)
+	{
+		size_t end = 0;
+		const uint64_t index_offset = read_le64(trailer, end);
+		if (memcmp(trailer + end, ARCHIVE_MAGIC, MAGIC_SIZE) != 0
+			|| index_offset < ARCHIVE_HEADER_SIZE || index_offset > file_size - TRAILER_SIZE - MIN_INDEX_SIZE)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		return index_offset;
+	}
+
+	vector<block_info> read_index(std::istream& in)
+	{
+		in.seekg(0, std::ios_base::end);
+		const uint64_t file_size = in.tellg();
+		if (!in || file_size < ARCHIVE_HEADER_SIZE + MIN_INDEX_SIZE + TRAILER_SIZE)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		byte header[ARCHIVE_HEADER_SIZE];
+		in.seekg(0);
+		read_exactly(in, header, ARCHIVE_HEADER_SIZE);
+		const archive_format format = read_archive_header(header);
+		byte trailer[TRAILER_SIZE];
+		in.seekg(file_size - TRAILER_SIZE);
+		read_exactly(in, trailer, TRAILER_SIZE);
+		const uint64_t index_offset = read_trailer(trailer, file_size);
+
+		vector<byte> index(file_size - TRAILER_SIZE - index_offset);
+		in.seekg(index_offset);
+		read_exactly(in, index.data(), index.size());
+		return parse_index(index.data(), index.size(), index_offset, format.version);
+	}
+
+	vector<block_info> read_index(const byte* archive, const uint64_t size)
+	{
+		if (size < ARCHIVE_HEADER_SIZE + MIN_INDEX_SIZE + TRAILER_SIZE)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		const archive_format format = read_archive_header(archive);
+		const uint64_t index_offset = read_trailer(archive + size - TRAILER_SIZE, size);
+		return parse_index(archive + index_offset, size - TRAILER_SIZE - index_offset, index_offset, format.version);
+	}
+
+	// the index and the trailer, returns their size
+	static uint64_t write_index(std::ostream& out, const vector<block_info>& index, const uint64_t index_offset)
+	{
+		vector<byte> x(1 + MAX_VARINT_SIZE + index.size() * 2 * MAX_VARINT_SIZE + TRAILER_SIZE);
+		size_t end = 0;
+		x[end++] = END_BLOCK;
+		write_varint(x.data(), index.size(), end);
+		for (size_t i = 0; i < index.size(); ++i)
+		{
+			const uint64_t next = i + 1 < index.size() ? index[i + 1].offset : index_offset;
+			write_varint(x.data(), next - index[i].offset, end);
+			write_varint(x.data(), index[i].raw_size, end);
+		}
+		write_le64(x.data(), index_offset, end);
+		memcpy(x.data() + end, ARCHIVE_MAGIC, MAGIC_SIZE);
+		end += MAGIC_SIZE;
+		out.write(reinterpret_cast<const char*>(x.data()), end);
+		return end;
+	}
+
+	// the index and the trailer that end a stream must list the blocks read before them, then the stream ends
+	static void check_index(std::istream& in, const vector<block_info>& blocks, const uint64_t index_offset, const byte version)
+	{
+		const uint64_t max_size = 1 + MAX_VARINT_SIZE + blocks.size() * 2 * MAX_VARINT_SIZE + TRAILER_SIZE;
+		vector<byte> x(max_size + 1); // one more byte shows trailing garbage
+		x[0] = END_BLOCK;
+		in.read(reinterpret_cast<char*>(x.data() + 1), max_size);
+		const uint64_t size = 1 + in.gcount();
+		if (size > max_size || size < MIN_INDEX_SIZE + TRAILER_SIZE
+			|| read_trailer(x.data() + size - TRAILER_SIZE, index_offset + size) != index_offset)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		const vector<block_info> index = parse_index(x.data(), size - TRAILER_SIZE, index_offset, version);
+		if (index.size() != blocks.size())
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		for (size_t i = 0; i < index.size(); ++i)
+		{
+			if (index[i].offset != blocks[i].offset || index[i].raw_size != blocks[i].raw_size)
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		}
+	}
+
+	/************************ pipeline: **************************************/
+
+	typedef std::shared_ptr<vector<byte>> shared_buffer;
+
+	// buffers the writer stage is done with, reused by the next blocks
+	class spare_buffers
+	{
+	public:
+		explicit spare_buffers(size_t capacity) : ring_(capacity)
+		{
+		}
+
+		shared_buffer get()
+		{
+			shared_buffer buffer;
+			if (!ring_.try_pop(buffer))
+				buffer = std::make_shared<vector<byte>>();
+			return buffer;
+		}
+
+		void put(shared_buffer& buffer) // dropped if the ring is full
+		{
+			if (buffer)
+				ring_.try_push(buffer);
+		}
+
+	private:
+		ring_buffer<shared_buffer> ring_;
+	};
+
+	// in is untied from its stream while the writer thread owns out: a tied stream
+	// flushes out before every read, which races with the writes (cin is tied to cout)
+	class untied_stream
+	{
+	public:
+		explicit untied_stream(std::istream& in) : in_(in), tie_(in.tie(nullptr))
+		{
+		}
+
+		~untied_stream()
+		{
+			in_.tie(tie_);
+		}
+
+		untied_stream(untied_stream const&) = delete;
+		untied_stream& operator=(untied_stream const&) = delete;
+
+	private:
+		std::istream& in_;
+		std::ostream* tie_;
+	};
+
+	/************************ compression: **************************************/
+
+	// next(buffer, block, size) gives the blocks in order, false at the end of input;
+	// a stream source reads into buffer, a mapped one points block into the mapping.
+	// This thread reads, the pool encodes and a writer thread writes in input order;
+	// a ring of two blocks per worker links them, so I/O waits overlap with coding
+	template <typename Source>
+	static archive_stats write_archive(Source next, std::ostream& out, const archive_options& options)
+	{
+		if (options.block_size == 0 || options.block_size > MAX_BLOCK_SIZE)
+			throw std::invalid_argument("block_size");
+		byte header[ARCHIVE_HEADER_SIZE];
+		memcpy(header, ARCHIVE_MAGIC, MAGIC_SIZE);
+		size_t end = MAGIC_SIZE;
+		header[end++] = ARCHIVE_VERSION;
+		header[end++] = options.checksums ? CHECKSUM_FLAG : 0;
+		write_le64(header, options.block_size, end);
+		out.write(reinterpret_cast<const char*>(header), ARCHIVE_HEADER_SIZE);
+
+		struct encoded_block
+		{
+			size_t raw_size;
+			shared_buffer buffer, packed;
+			std::future<uint64_t> limit_loss;
+		};
+		thread_pool pool(options.threads);
+		ring_buffer<encoded_block> encoded(2 * pool.size());
+		spare_buffers spare(4 * pool.size() + 2);
+		vector<block_info> index;
+		archive_stats stats;
+		uint64_t offset = ARCHIVE_HEADER_SIZE;
+		std::exception_ptr error; // of the first failed block, the blocks after it are dropped
+		std::atomic<bool> failed(false);
+		std::thread writer([&]()
+		{
+			encoded_block block;
+			while (encoded.pop(block))
+			{
+				try
+				{
+					const uint64_t limit_loss = block.limit_loss.get();
+					if (!error)
+					{
+						out.write(reinterpret_cast<const char*>(block.packed->data()), block.packed->size());
+						block_info info;
+						info.offset = offset;
+						info.raw_size = block.raw_size;
+						index.push_back(info);
+						offset += block.packed->size();
+						stats.raw_size += info.raw_size;
+						stats.limit_loss += limit_loss;
+					}
+				}
+				catch (...)
+				{
+					if (!error)
+						error = std::current_exception();
+					failed = true;
+				}
+				spare.put(block.buffer);
+				spare.put(block.packed);
+			}
+		});
+		auto stop = [&]()
+		{
+			encoded.close();
+			writer.join();
+		};
+
+		try
+		{
+			while (!failed)
+			{
+				encoded_block block;
+				block.buffer = spare.get(); // owns the block unless it lives in a mapping
+				const byte* data;
+				if (!next(block.buffer, data, block.raw_size))
+					break;
+				block.packed = spare.get();
+				const shared_buffer packed = block.packed;
+				const size_t size = block.raw_size;
+				block.limit_loss = pool.submit([packed, data, size, options]()
+				{
+					packed->clear();
+					return encode_block(data, size, *packed, options);
+				});
+				encoded.push(std::move(block));
+			}
+		}
+		catch (...)
+		{
+			stop();
+			throw;
+		}
+		stop();
+		if (error)
+			std::rethrow_exception(error);
+		stats.packed_size = offset + write_index(out, index, offset);
+		if (!out)
+			throw HuffException(HuffException::OUTFILE_NOT_OPEN, "");
+		return stats;
+	}
+
+	archive_stats compress_stream(std::istream& in, std::ostream& out, const archive_options& options)
+	{
+		const untied_stream untied(in);
+		bool done = false;
+		return write_archive([&](shared_buffer& buffer, const byte*& block, size_t& size)
+		{
+			if (done)
+				return false;
+			buffer->resize(options.block_size);
+			in.read(reinterpret_cast<char*>(buffer->data()), buffer->size());
+			block = buffer->data();
+			size = in.gcount();
+			done = !in;
+			return size != 0;
+		}, out, options);
+	}
+
+	archive_stats compress_file(const string& filename_in, const string& filename_out, const archive_options& options)
+	{
+		mapped_file input;
+		const bool mapped = options.mapped && input.open_read(filename_in);
+		std::ifstream fin;
+		if (!mapped)
+		{
+			fin.open(filename_in.c_str(), std::ios_base::binary);
+			if (!fin.is_open())
+				throw HuffException(HuffException::INFILE_NOT_OPEN, filename_in);
+		}
+		std::ofstream fout(filename_out.c_str(), std::ios_base::binary);
+		if (!fout.is_open())
+			throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename_out);
+
+		try
+		{
+			if (!mapped)
+				return compress_stream(fin, fout, options);
+			uint64_t position = 0;
+			return write_archive([&](shared_buffer&, const byte*& block, size_t& size)
+			{
+				block = input.data() + position;
+				size = std::min<uint64_t>(options.block_size, input.size() - position);
+				position += size;
+				return size != 0;
+			}, fout, options);
+		}
+		catch (const HuffException& e)
+		{
+			if (!e.get_filename().empty())
+				throw;
+			throw HuffException(e.get_error(), filename_out);
+		}
+	}
+
+	/************************ decompression: **************************************/
+
+	static void decompress_legacy(const string& filename_in, const string& filename_out, const string& filename_hf)
+	{
+		std::ifstream fhf(filename_hf.c_str(), std::ios_base::binary);
+		if (!fhf.is_open())
+			throw HuffException(HuffException::INFILE_NOT_OPEN, filename_hf);
+		vector<char> input_chunk(BUFFER);
+		HuffmanDecoder decoder;
+		for (;;) // read & build tree
+		{
+			fhf.read(input_chunk.data(), BUFFER);
+			const auto chunk = reinterpret_cast<const byte*>(input_chunk.data());
+			decoder.append(chunk, fhf.gcount());
+			if (!fhf)
+			{
+				decoder.append(chunk, 0); // build tree
+				break;
+			}
+		}
+		if (!decoder.valid())
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, filename_hf);
+
+		std::ifstream fin(filename_in.c_str(), std::ios_base::binary);
+		if (!fin.is_open())
+			throw HuffException(HuffException::INFILE_NOT_OPEN, filename_in);
+		std::ofstream fout(filename_out.c_str(), std::ios_base::binary);
+		if (!fout.is_open())
+			throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename_out);
+		// the payload starts with its size, LE64 as the 64-bit builds that wrote it had it
+		byte size_field[8] = {};
+		fin.read(reinterpret_cast<char*>(size_field), sizeof size_field);
+		size_t end = 0;
+		uint64_t main_size = read_le64(size_field, end);
+		vector<byte> output;
+		for (;;)
+		{
+			fin.read(input_chunk.data(), BUFFER);
+			decoder.decode(reinterpret_cast<const byte*>(input_chunk.data()), fin.gcount(), output);
+			const size_t out_size = std::min<uint64_t>(main_size, output.size());
+			if (!output.empty())
+			{
+				fout.write(reinterpret_cast<const char*>(&output[0]), out_size);
+				main_size -= out_size;
+			}
+			if (!fin || !out_size)
+				break;
+		}
+		if (main_size != 0) // fewer symbols than the payload claims
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, filename_in);
+	}
+
+	// blocks in input order: the pool decodes them and a writer thread writes those without a target
+	// to out, so reading, decoding and writing overlap; push waits while two blocks per worker
+	// or options.memory of packed and decoded bytes are in flight
+	class block_queue
+	{
+	public:
+		block_queue(const archive_options& options, const archive_format& format, std::ostream* out)
+			: options_(options), format_(format), out_(out), pool_(options.threads), pending_(2 * pool_.size()),
+			  spare_(4 * pool_.size() + 2), writer_(&block_queue::write, this)
+		{
+		}
+
+		~block_queue()
+		{
+			if (!writer_.joinable())
+				return;
+			pending_.close();
+			writer_.join();
+		}
+
+		shared_buffer buffer() // for the caller to read a packed block into
+		{
+			return spare_.get();
+		}
+
+		// target is where the block decodes to, or nullptr to write it to out in order;
+		// checksum is checked if the archive has them and options.verify is set
+		void push(const block_header& block, const shared_buffer& buffer, const byte* packed, byte* target,
+		          const uint32_t checksum)
+		{
+			const size_t memory = (buffer ? buffer->size() : 0) + (target ? 0 : block.raw_size);
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				room_.wait(lock, [&]() { return in_flight_ == 0 || in_flight_ + memory <= options_.memory; });
+				in_flight_ += memory;
+				if (error_)
+				{
+					lock.unlock();
+					finish();
+				}
+			}
+			pending_block task;
+			task.memory = memory;
+			task.buffer = buffer;
+			if (!target)
+				task.decoded = spare_.get();
+			const shared_buffer decoded = task.decoded;
+			const bool verify = format_.checksum_size != 0 && options_.verify;
+			const byte version = format_.version;
+			task.done = pool_.submit([block, packed, target, decoded, verify, version, checksum]()
+			{
+				if (verify && block_checksum(block, packed, version) != checksum)
+					throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+				if (target)
+					return decode_block(block, packed, target);
+				decoded->resize(block.raw_size);
+				decode_block(block, packed, decoded->data());
+			});
+			pending_.push(std::move(task));
+		}
+
+		void finish() // rethrows the first error of a block
+		{
+			pending_.close();
+			writer_.join();
+			if (error_)
+				std::rethrow_exception(error_);
+			if (out_ && !*out_)
+				throw HuffException(HuffException::OUTFILE_NOT_OPEN, "");
+		}
+
+	private:
+		struct pending_block
+		{
+			size_t memory;
+			shared_buffer buffer, decoded;
+			std::future<void> done;
+		};
+
+		void write()
+		{
+			pending_block task;
+			while (pending_.pop(task))
+			{
+				try
+				{
+					task.done.get();
+					if (task.decoded && !error_)
+						out_->write(reinterpret_cast<const char*>(task.decoded->data()), task.decoded->size());
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					if (!error_)
+						error_ = std::current_exception();
+				}
+				spare_.put(task.buffer);
+				spare_.put(task.decoded);
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					in_flight_ -= task.memory;
+				}
+				room_.notify_one();
+			}
+		}
+
+		const archive_options& options_;
+		const archive_format format_;
+		std::ostream* out_;
+		thread_pool pool_;
+		ring_buffer<pending_block> pending_;
+		spare_buffers spare_;
+		std::mutex mutex_;
+		std::condition_variable room_;
+		size_t in_flight_ = 0;
+		std::exception_ptr error_; // set by the writer only
+		std::thread writer_; // last, it starts with the members above
+	};
+
+	void decompress_stream(std::istream& in, std::ostream& out, const archive_options& options)
+	{
+		const untied_stream untied(in); // outlives the writer thread of queue
+		byte header[ARCHIVE_HEADER_SIZE];
+		read_exactly(in, header, ARCHIVE_HEADER_SIZE);
+		const archive_format format = read_archive_header(header);
+		// blocks are walked through their headers, then the index after END_BLOCK has to list them
+		block_queue queue(options, format, &out);
+		vector<block_info> blocks;
+		uint64_t offset = ARCHIVE_HEADER_SIZE;
+		block_header block;
+		uint32_t checksum;
+		for (;;)
+		{
+			block_info info;
+			info.offset = offset;
+			if (!read_block_header(in, format, block, checksum, offset))
+				break;
+			check_block_header(block, format.block_size);
+			const shared_buffer buffer = queue.buffer();
+			read_exactly(in, *buffer, block.packed_size());
+			queue.push(block, buffer, buffer->data(), nullptr, checksum);
+			info.raw_size = block.raw_size;
+			blocks.push_back(info);
+			offset += block.packed_size();
+		}
+		check_index(in, blocks, offset - 1, format.version); // offset is past END_BLOCK
+		queue.finish();
+	}
+
+	// blocks are found through the index, a mapped output is filled by the workers
+	// at the block offsets, otherwise decoded blocks are written in order
+	static void decompress_mapped(const mapped_file& archive, const string& filename_out, const archive_options& options)
+	{
+		const archive_format format = read_archive_header(archive.data());
+		const vector<block_info> index = read_index(archive.data(), archive.size());
+		uint64_t total = 0;
+		for (const auto& info : index)
+		{
+			if (info.raw_size > format.block_size || info.raw_size > UINT64_MAX - total)
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+			total += info.raw_size;
+		}
+
+		mapped_file output;
+		std::ofstream fout;
+		if (!output.create(filename_out, total))
+		{
+			fout.open(filename_out.c_str(), std::ios_base::binary);
+			if (!fout.is_open())
+				throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename_out);
+		}
+		block_queue queue(options, format, &fout);
+		uint64_t output_offset = 0;
+		for (size_t i = 0; i < index.size(); ++i)
+		{
+			size_t end = index[i].offset;
+			const block_header block = read_block_header(archive.data(), archive.size(), end, format.version);
+			check_block_header(block, format.block_size);
+			if (format.checksum_size > archive.size() - end)
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+			const uint32_t checksum = format.checksum_size != 0 ? read_checksum(archive.data() + end) : 0;
+			end += format.checksum_size;
+			const uint64_t next = i + 1 < index.size() ? index[i + 1].offset : 0;
+			if (block.packed_size() > archive.size() - end || block.raw_size != index[i].raw_size
+				|| (next != 0 && next != end + block.packed_size())
+				|| (output.data() && block.raw_size > output.size() - output_offset))
+				throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+			byte* const target = output.data() ? output.data() + output_offset : nullptr;
+			queue.push(block, nullptr, archive.data() + end, target, checksum);
+			output_offset += block.raw_size;
+		}
+		queue.finish();
+	}
+
+	void decompress_file(const string& filename_in, const string& filename_out,
+	                     const archive_options& options, const string& filename_hf)
+	{
+		mapped_file archive;
+		const bool mapped = options.mapped && archive.open_read(filename_in);
+		std::ifstream fin;
+		byte magic[MAGIC_SIZE];
+		size_t magic_size;
+		if (mapped)
+		{
+			magic_size = std::min(archive.size(), MAGIC_SIZE);
+			memcpy(magic, archive.data(), magic_size);
+		}
+		else
+		{
+			fin.open(filename_in.c_str(), std::ios_base::binary);
+			if (!fin.is_open())
+				throw HuffException(HuffException::INFILE_NOT_OPEN, filename_in);
+			fin.read(reinterpret_cast<char*>(magic), MAGIC_SIZE);
+			magic_size = fin.gcount();
+			fin.seekg(0);
+		}
+		if (magic_size < MAGIC_SIZE || memcmp(magic, ARCHIVE_MAGIC, MAGIC_SIZE) != 0)
+		{
+			archive.close();
+			fin.close();
+			decompress_legacy(filename_in, filename_out, filename_hf);
+			return;
+		}
+
+		try
+		{
+			if (mapped)
+			{
+				if (archive.size() < ARCHIVE_HEADER_SIZE)
+					throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+				decompress_mapped(archive, filename_out, options);
+				return;
+			}
+			std::ofstream fout(filename_out.c_str(), std::ios_base::binary);
+			if (!fout.is_open())
+				throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename_out);
+			decompress_stream(fin, fout, options);
+		}
+		catch (const HuffException& e)
+		{
+			if (!e.get_filename().empty())
+				throw;
+			throw HuffException(e.get_error(), e.get_error() == HuffException::OUTFILE_NOT_OPEN ? filename_out : filename_in);
+		}
+	}
+
+	void decompress_range(const string& filename_in, std::ostream& out, const uint64_t offset, const uint64_t length,
+	                      const archive_options& options)
+	{
+		std::ifstream fin(filename_in.c_str(), std::ios_base::binary);
+		if (!fin.is_open())
+			throw HuffException(HuffException::INFILE_NOT_OPEN, filename_in);
+		const uint64_t range_end = length > UINT64_MAX - offset ? UINT64_MAX : offset + length;
+		try
+		{
+			const vector<block_info> index = read_index(fin);
+			byte header[ARCHIVE_HEADER_SIZE];
+			fin.seekg(0);
+			read_exactly(fin, header, ARCHIVE_HEADER_SIZE);
+			const archive_format format = read_archive_header(header);
+
+			vector<byte> packed, decoded;
+			uint64_t position = 0; // of the block in the original
+			for (const auto& info : index)
+			{
+				const uint64_t begin = position;
+				position += info.raw_size;
+				if (position <= offset)
+					continue;
+				if (begin >= range_end)
+					break;
+				fin.seekg(info.offset);
+				block_header block;
+				uint32_t checksum;
+				uint64_t block_offset = info.offset;
+				if (!read_block_header(fin, format, block, checksum, block_offset))
+					throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+				check_block_header(block, format.block_size);
+				if (block.raw_size != info.raw_size)
+					throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+				read_exactly(fin, packed, block.packed_size());
+				if (format.checksum_size != 0 && options.verify
+					&& block_checksum(block, packed.data(), format.version) != checksum)
+					throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+				decoded.resize(block.raw_size);
+				decode_block(block, packed.data(), decoded.data());
+				const uint64_t from = std::max(offset, begin) - begin;
+				const uint64_t to = std::min(range_end, position) - begin;
+				out.write(reinterpret_cast<const char*>(decoded.data() + from), to - from);
+			}
+			if (!out)
+				throw HuffException(HuffException::OUTFILE_NOT_OPEN, "");
+		}
+		catch (const HuffException& e)
+		{
+			if (!e.get_filename().empty() || e.get_error() == HuffException::OUTFILE_NOT_OPEN)
+				throw;
+			throw HuffException(e.get_error(), filename_in);
+		}
+	}
+}
@@ -0,0 +1,117 @@
+#ifndef HUFFARCHIVE_H
+#define HUFFARCHIVE_H
+
+
+#include "huffman.h"
+#include "huffcontext.h"
+#include <istream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace huffman
+{
+	/*
+	 * .huf archive:
+	 *   header:  magic, version, flags, block size (LE64)
+	 *   blocks:  type, raw size, table size, payload size, [checksum], table, payload
+	 *            (HUFFMAN4_BLOCK payloads are encode_interleaved output,
+	 *            CONTEXT_BLOCK tables and payloads come from ContextEncoder,
+	 *            STORED_BLOCK has no table and the raw bytes as payload)
+	 *   index:   END_BLOCK, block count, (block size in the archive, raw size) per block
+	 *   trailer: index offset (LE64), magic
+	 * sizes in blocks and in the index are varints, so small blocks keep small headers;
+	 * version 1 archives, which are still read, have LE64 sizes and (offset, raw size) index entries.
+	 * Every block has its own canonical table and decodes on its own;
+	 * with CHECKSUM_FLAG each block header is followed by the CRC32C (LE32)
+	 * of the header, table and payload
+	 */
+	const byte ARCHIVE_MAGIC[] = {'H', 'U', 'F', 0x1a};
+	const size_t MAGIC_SIZE = sizeof ARCHIVE_MAGIC;
+	const byte ARCHIVE_VERSION = 2;
+	const size_t ARCHIVE_HEADER_SIZE = MAGIC_SIZE + 1 + 1 + 8;
+	const size_t MAX_BLOCK_HEADER_SIZE = 1 + 3 * MAX_VARINT_SIZE;
+	const size_t MIN_INDEX_SIZE = 2; // END_BLOCK and no blocks
+	const size_t TRAILER_SIZE = 8 + MAGIC_SIZE;
+	const size_t BLOCK_SIZE = 1 << 20;
+	const size_t MAX_BLOCK_SIZE = 1 << 30; // larger ones are refused, so a header cannot ask for any memory
+	const byte CHECKSUM_FLAG = 1;
+	const size_t CHECKSUM_SIZE = 4;
+	// a block is stored unless coding saves this fraction of it, estimated from its histogram
+	const size_t STORED_GAIN = 64;
+
+	enum block_type { END_BLOCK = 0, HUFFMAN_BLOCK = 1, HUFFMAN4_BLOCK = 2, CONTEXT_BLOCK = 3, STORED_BLOCK = 4 };
+
+	struct block_header
+	{
+		block_type type;
+		uint64_t raw_size;
+		uint64_t table_size;
+		uint64_t payload_size;
+
+		uint64_t packed_size() const
+		{
+			return table_size + payload_size;
+		}
+	};
+
+	struct block_info
+	{
+		uint64_t offset; // of the block header from the start of the archive
+		uint64_t raw_size;
+	};
+
+	struct archive_options
+	{
+		size_t block_size = BLOCK_SIZE; // 1 to MAX_BLOCK_SIZE
+		size_t threads = 1; // 0 means one per core
+		size_t memory = 64 << 20; // packed and decoded bytes of blocks in flight while decoding
+		bool mapped = true; // map regular files instead of reading them through streams
+		size_t max_code_length = MAX_CODE_LENGTH;
+		bool interleaved = false; // HUFFMAN4_BLOCK: larger by a jump table, faster to decode
+		bool context = false; // CONTEXT_BLOCK: order-1 tables, better ratio on text, takes over interleaved
+		bool checksums = true; // written with every block
+		bool verify = true; // checksums of the archive are checked while decoding
+	};
+
+	struct archive_stats
+	{
+		uint64_t raw_size = 0;
+		uint64_t packed_size = 0;
+		uint64_t limit_loss = 0; // payload bits lost to max_code_length
+	};
+
+	// at most MAX_BLOCK_HEADER_SIZE bytes
+	void write_block_header(byte* x, const block_header& header, size_t& end, byte version = ARCHIVE_VERSION);
+	// throws unless the whole header lies before size
+	block_header read_block_header(const byte* x, size_t size, size_t& end, byte version = ARCHIVE_VERSION);
+
+	// appends header, table and payload of one block to output,
+	// returns the payload bits lost to max_code_length
+	uint64_t encode_block(const byte* input, size_t size, vector<byte>& output,
+	                      const archive_options& options = archive_options());
+	// packed is the table and payload after the header, output gets header.raw_size bytes
+	void decode_block(const block_header& header, const byte* packed, byte* output);
+
+	vector<block_info> read_index(std::istream& in);
+	vector<block_info> read_index(const byte* archive, uint64_t size);
+
+	// single pass over in, one block buffered per worker; errors carry no file name.
+	// decompress_stream checks the index against the blocks and wants the stream to end after the trailer
+	archive_stats compress_stream(std::istream& in, std::ostream& out, const archive_options& options = archive_options());
+	void decompress_stream(std::istream& in, std::ostream& out, const archive_options& options = archive_options());
+
+	archive_stats compress_file(const string& filename_in, const string& filename_out,
+	                            const archive_options& options = archive_options());
+	// archives and the old payload + tree file pair (filename_hf) both decode
+	void decompress_file(const string& filename_in, const string& filename_out,
+	                     const archive_options& options = archive_options(),
+	                     const string& filename_hf = "output.hf");
+	// bytes [offset, offset + length) of the original, cut at its end;
+	// only the blocks the index puts in the range are read and decoded
+	void decompress_range(const string& filename_in, std::ostream& out, uint64_t offset, uint64_t length,
+	                      const archive_options& options = archive_options());
+}
+
+
+#endif
@@ -0,0 +1,173 @@
+#include "huffcontext.h"
+#include <cassert>
+#include <climits>
+#include <cmath>
+
+namespace huffman
+{
+	/************************ ContextEncoder CLASS: **************************************/
+
+	void ContextEncoder::append(const byte* data, const size_t len)
+	{
+		if (len == 0)
+		{
+			build();
+			return;
+		}
+		uint64_t* const row = counts.data();
+		row[prev * ALPHABET + data[0]]++;
+		for (size_t i = 1; i < len; ++i)
+			row[data[i - 1] * ALPHABET + data[i]]++;
+		prev = data[len - 1];
+	}
+
+	void ContextEncoder::build()
+	{
+		uint64_t order0[ALPHABET] = {};
+		uint64_t total = 0;
+		for (size_t p = 0; p < ALPHABET; ++p)
+			for (size_t s = 0; s < ALPHABET; ++s)
+				order0[s] += counts[p * ALPHABET + s];
+		for (size_t s = 0; s < ALPHABET; ++s)
+			total += order0[s];
+
+		// a context gets its own table if its entropy against the order-0 one
+		// saves more than the table costs, the others share the last table
+		uint64_t shared[ALPHABET] = {};
+		bool rare[ALPHABET] = {};
+		bool merged = false;
+		for (size_t p = 0; p < ALPHABET; ++p)
+		{
+			const uint64_t* row = &counts[p * ALPHABET];
+			uint64_t size = 0;
+			for (size_t s = 0; s < ALPHABET; ++s)
+				size += row[s];
+			if (size == 0)
+				continue;
+			double own = 0, order0_bits = 0;
+			for (size_t s = 0; s < ALPHABET; ++s)
+			{
+				if (row[s] == 0)
+					continue;
+				own += row[s] * std::log2(static_cast<double>(size) / row[s]);
+				order0_bits += row[s] * std::log2(static_cast<double>(total) / order0[s]);
+			}
+			if (order0_bits - own > CONTEXT_TABLE_SIZE * CHAR_BIT)
+			{
+				context[p] = static_cast<byte>(tables.size());
+				tables.emplace_back(CANONICAL_CODES, length_limit);
+				tables.back().append_counts(row);
+				continue;
+			}
+			for (size_t s = 0; s < ALPHABET; ++s)
+				shared[s] += row[s];
+			merged = true;
+			rare[p] = true;
+		}
+		if (merged || tables.empty())
+		{
+			for (size_t p = 0; p < ALPHABET; ++p)
+				if (rare[p])
+					context[p] = static_cast<byte>(tables.size());
+			tables.emplace_back(CANONICAL_CODES, length_limit);
+			tables.back().append_counts(shared);
+		}
+		for (auto& table : tables)
+			table.append(nullptr, 0);
+	}
+
+	void ContextEncoder::write_tables(vector<byte>& output)
+	{
+		output.push_back(static_cast<byte>(tables.size()));
+		output.push_back(static_cast<byte>(tables.size() >> 8));
+		output.insert(output.end(), context, context + ALPHABET);
+		for (auto& table : tables)
+		{
+			assert(table.header_size() == CONTEXT_TABLE_SIZE);
+			output.resize(output.size() + CONTEXT_TABLE_SIZE);
+			table.write_header(&output[output.size() - CONTEXT_TABLE_SIZE], CONTEXT_TABLE_SIZE);
+		}
+	}
+
+	void ContextEncoder::encode(const byte* input, const size_t len, vector<byte>& output)
+	{
+		size_t max_length = 0;
+		for (auto& table : tables)
+			for (size_t s = 0; s < ALPHABET; ++s)
+				max_length = std::max(max_length, table.get_code(static_cast<byte>(s)).length);
+		output.clear();
+		output.resize(bit_writer::max_size(len, max_length));
+		writer.reset(output.data());
+		byte previous = 0;
+		for (size_t i = 0; i < len; ++i)
+		{
+			const code_word& code = tables[context[previous]].get_code(input[i]);
+			assert(code.length != 0);
+			writer.put(code.bits, code.length);
+			previous = input[i];
+		}
+		writer.flush();
+		output.resize(writer.position() - output.data());
+	}
+
+	uint64_t ContextEncoder::limit_loss() const
+	{
+		uint64_t loss = 0;
+		for (const auto& table : tables)
+			loss += table.limit_loss();
+		return loss;
+	}
+
+	uint64_t ContextEncoder::payload_bits() const
+	{
+		uint64_t bits = 0;
+		for (size_t p = 0; p < ALPHABET; ++p)
+			for (size_t s = 0; s < ALPHABET; ++s)
+				bits += counts[p * ALPHABET + s] * tables[context[p]].get_code(static_cast<byte>(s)).length;
+		return bits;
+	}
+
+	/************************ ContextDecoder CLASS: **************************************/
+
+	bool ContextDecoder::read_tables(const byte* input, const size_t size)
+	{
+		if (size < 2 + ALPHABET)
+			return false;
+		const size_t count = input[0] | (static_cast<size_t>(input[1]) << 8);
+		if (count == 0 || count > ALPHABET || size != 2 + ALPHABET + count * CONTEXT_TABLE_SIZE)
+			return false;
+		for (size_t p = 0; p < ALPHABET; ++p)
+		{
+			context_[p] = input[2 + p];
+			if (context_[p] >= count)
+				return false;
+		}
+		tables_.assign(count, HuffmanDecoder());
+		const byte* table = input + 2 + ALPHABET;
+		for (auto& decoder : tables_)
+		{
+			size_t end = 0;
+			if (read_int_from_byte_array(table, CONTEXT_TABLE_SIZE, end) != CANONICAL_TAG
+				|| !valid_code_lengths(table + end))
+				return false;
+			decoder.append(table, CONTEXT_TABLE_SIZE);
+			decoder.append(table, 0);
+			table += CONTEXT_TABLE_SIZE;
+		}
+		return true;
+	}
+
+	bool ContextDecoder::decode(const byte* input, const size_t size, byte* output, const size_t output_size) const
+	{
+		bit_reader reader;
+		reader.reset(input, size);
+		byte previous = 0;
+		for (size_t i = 0; i < output_size; ++i)
+		{
+			if (!tables_[context_[previous]].decode_symbol(reader, output[i]))
+				return false;
+			previous = output[i];
+		}
+		return true;
+	}
+}
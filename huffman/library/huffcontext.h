@@ -0,0 +1,58 @@
+#ifndef HUFFCONTEXT_H
+#define HUFFCONTEXT_H
+
+
+#include "huffman.h"
+
+namespace huffman
+{
+	/*
+	 * order-1 coding: the code of a symbol comes from the table of the byte before it
+	 * (0 before the first symbol). Contexts that would not pay for their own table
+	 * share one. Tables: table count (LE16), table of every previous byte (ALPHABET),
+	 * then a canonical HuffmanEncoder header per table.
+	 */
+	const size_t CONTEXT_TABLE_SIZE = 4 + ALPHABET;
+	const size_t MAX_CONTEXT_TABLES_SIZE = 2 + ALPHABET + ALPHABET * CONTEXT_TABLE_SIZE;
+
+	class ContextEncoder
+	{
+	public:
+		explicit ContextEncoder(size_t length_limit = MAX_CODE_LENGTH)
+			: length_limit(length_limit), counts(ALPHABET * ALPHABET)
+		{
+		};
+		void append(const byte* data, size_t len); // add symbols, len = 0 builds the tables
+		void write_tables(vector<byte>& output); // appends them to output
+		// the symbols of append in one call, the stream is flushed at the end
+		void encode(const byte* input, size_t len, vector<byte>& output);
+		uint64_t limit_loss() const;
+		uint64_t payload_bits() const; // of the appended symbols, once the tables are built
+
+	private:
+		size_t length_limit;
+		vector<uint64_t> counts; // [previous byte][symbol]
+		byte prev = 0;
+		byte context[ALPHABET] = {}; // table of each previous byte
+		vector<HuffmanEncoder> tables;
+		bit_writer writer;
+	private:
+		void build();
+	};
+
+	class ContextDecoder
+	{
+	public:
+		// false if input is not exactly the tables of a ContextEncoder
+		bool read_tables(const byte* input, size_t size);
+		// false if input ends before output_size symbols
+		bool decode(const byte* input, size_t size, byte* output, size_t output_size) const;
+
+	private:
+		byte context_[ALPHABET] = {};
+		vector<HuffmanDecoder> tables_;
+	};
+}
+
+
+#endif
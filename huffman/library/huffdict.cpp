@@ -0,0 +1,212 @@
+#include "huffdict.h"
+#include "crc32c.h"
+#include "huffexception.h"
+#include "thread_pool.h"
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <deque>
+#include <fstream>
+
+namespace huffman
+{
+	/************************ HuffDictionary CLASS: **************************************/
+
+	HuffDictionary::HuffDictionary(const uint64_t* counts, const size_t length_limit)
+	{
+		uint64_t freqs[ALPHABET];
+		for (size_t s = 0; s < ALPHABET; ++s)
+			freqs[s] = counts[s] + 1; // so inputs unlike the samples still code
+		size_t end = 0;
+		write_int_to_byte_array(table_, CANONICAL_TAG, end);
+		limit_code_lengths(freqs, length_limit, table_ + end);
+		build();
+	}
+
+	HuffDictionary::HuffDictionary(const byte* input, const size_t size)
+	{
+		size_t end = sizeof DICTIONARY_MAGIC;
+		if (size != DICTIONARY_SIZE || memcmp(input, DICTIONARY_MAGIC, sizeof DICTIONARY_MAGIC) != 0
+			|| read_int_from_byte_array(input, size, end) != CANONICAL_TAG
+			|| !valid_code_lengths(input + end)
+			|| std::find(input + end, input + size, 0) != input + size)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		memcpy(table_, input + sizeof DICTIONARY_MAGIC, DICTIONARY_TABLE_SIZE);
+		build();
+	}
+
+	void HuffDictionary::build()
+	{
+		const byte* lengths = table_ + 4;
+		uint64_t canonical[ALPHABET];
+		canonical_codes(lengths, canonical);
+		for (size_t s = 0; s < ALPHABET; ++s)
+		{
+			codes_[s].bits = canonical[s];
+			codes_[s].length = lengths[s];
+			max_length_ = std::max(max_length_, codes_[s].length);
+		}
+		decoder_.append(table_, DICTIONARY_TABLE_SIZE);
+		decoder_.append(table_, 0);
+		id_ = crc32c(table_, DICTIONARY_TABLE_SIZE);
+	}
+
+	void HuffDictionary::write(vector<byte>& output) const
+	{
+		output.insert(output.end(), DICTIONARY_MAGIC, DICTIONARY_MAGIC + sizeof DICTIONARY_MAGIC);
+		output.insert(output.end(), table_, table_ + DICTIONARY_TABLE_SIZE);
+	}
+
+	void HuffDictionary::encode(const byte* input, const size_t size, vector<byte>& output) const
+	{
+		size_t end = output.size();
+		output.resize(end + CODED_HEADER_SIZE + MAX_VARINT_SIZE + bit_writer::max_size(size, max_length_));
+		memcpy(output.data() + end, CODED_MAGIC, sizeof CODED_MAGIC);
+		end += sizeof CODED_MAGIC;
+		for (size_t i = 0; i < 4; ++i)
+			output[end++] = static_cast<byte>(id_ >> (8 * i));
+		write_varint(output.data(), size, end);
+		bit_writer writer;
+		writer.reset(output.data() + end);
+		for (size_t i = 0; i < size; ++i)
+		{
+			const code_word& code = codes_[input[i]];
+			writer.put(code.bits, code.length);
+		}
+		writer.flush();
+		output.resize(writer.position() - output.data());
+	}
+
+	void HuffDictionary::decode(const byte* input, const size_t size, vector<byte>& output) const
+	{
+		if (size < CODED_HEADER_SIZE || memcmp(input, CODED_MAGIC, sizeof CODED_MAGIC) != 0)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		size_t end = sizeof CODED_MAGIC;
+		uint32_t id = 0;
+		for (size_t i = 0; i < 4; ++i)
+			id |= static_cast<uint32_t>(input[end++]) << (8 * i);
+		uint64_t raw_size;
+		// every code takes a bit at least
+		if (id != id_ || !read_varint(input, size, end, raw_size) || raw_size > (size - end) * CHAR_BIT)
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+		output.resize(raw_size);
+		if (!decoder_.decode_stream(input + end, size - end, output.data(), raw_size))
+			throw HuffException(HuffException::UNCORRECT_FILE_FORMAT, "");
+	}
+
+	/************************ files: **************************************/
+
+	static vector<byte> read_whole(const string& filename)
+	{
+		std::ifstream in(filename.c_str(), std::ios_base::binary);
+		if (!in.is_open())
+			throw HuffException(HuffException::INFILE_NOT_OPEN, filename);
+		in.seekg(0, std::ios_base::end);
+		vector<byte> data(static_cast<size_t>(in.tellg()));
+		in.seekg(0);
+		in.read(reinterpret_cast<char*>(data.data()), data.size());
+		if (static_cast<size_t>(in.gcount()) != data.size())
+			throw HuffException(HuffException::INFILE_NOT_OPEN, filename);
+		return data;
+	}
+
+	static void write_whole(const string& filename, const vector<byte>& data)
+	{
+		std::ofstream out(filename.c_str(), std::ios_base::binary);
+		if (!out.is_open())
+			throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename);
+		out.write(reinterpret_cast<const char*>(data.data()), data.size());
+		if (!out)
+			throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename);
+	}
+
+	// task(filename) for every file on the pool, at most two files per worker waiting
+	template <typename Task>
+	static void for_each_file(const vector<string>& filenames, const size_t threads, Task task)
+	{
+		thread_pool pool(threads);
+		std::deque<std::future<void>> pending;
+		for (const auto& filename : filenames)
+		{
+			if (pending.size() == 2 * pool.size())
+			{
+				pending.front().get();
+				pending.pop_front();
+			}
+			pending.push_back(pool.submit([&task, &filename]() { task(filename); }));
+		}
+		for (auto& done : pending)
+			done.get();
+	}
+
+	HuffDictionary train_dictionary(const vector<string>& filenames, const size_t length_limit)
+	{
+		uint64_t counts[ALPHABET] = {};
+		vector<char> buffer(1 << 16);
+		for (const auto& filename : filenames)
+		{
+			std::ifstream in(filename.c_str(), std::ios_base::binary);
+			if (!in.is_open())
+				throw HuffException(HuffException::INFILE_NOT_OPEN, filename);
+			while (in.read(buffer.data(), buffer.size()) || in.gcount() > 0)
+			{
+				const size_t size = static_cast<size_t>(in.gcount());
+				for (size_t i = 0; i < size; ++i)
+					++counts[static_cast<byte>(buffer[i])];
+			}
+		}
+		return HuffDictionary(counts, length_limit);
+	}
+
+	void save_dictionary(const HuffDictionary& dictionary, const string& filename)
+	{
+		vector<byte> data;
+		dictionary.write(data);
+		write_whole(filename, data);
+	}
+
+	HuffDictionary load_dictionary(const string& filename)
+	{
+		const vector<byte> data = read_whole(filename);
+		try
+		{
+			return HuffDictionary(data.data(), data.size());
+		}
+		catch (const HuffException& e)
+		{
+			throw HuffException(e.get_error(), filename);
+		}
+	}
+
+	void compress_files(const HuffDictionary& dictionary, const vector<string>& filenames, const size_t threads)
+	{
+		for_each_file(filenames, threads, [&dictionary](const string& filename)
+		{
+			const vector<byte> data = read_whole(filename);
+			vector<byte> packed;
+			dictionary.encode(data.data(), data.size(), packed);
+			write_whole(filename + CODED_SUFFIX, packed);
+		});
+	}
+
+	void decompress_files(const HuffDictionary& dictionary, const vector<string>& filenames, const size_t threads)
+	{
+		const string suffix = CODED_SUFFIX;
+		for_each_file(filenames, threads, [&dictionary, &suffix](const string& filename)
+		{
+			const vector<byte> packed = read_whole(filename);
+			vector<byte> data;
+			try
+			{
+				dictionary.decode(packed.data(), packed.size(), data);
+			}
+			catch (const HuffException& e)
+			{
+				throw HuffException(e.get_error(), filename);
+			}
+			const bool coded = filename.size() > suffix.size()
+				&& filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0;
+			write_whole(coded ? filename.substr(0, filename.size() - suffix.size()) : filename + ".out", data);
+		});
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef HUFFDICT_H
+#define HUFFDICT_H
+
+
+#include "huffman.h"
+#include <string>
+#include <vector>
+
+namespace huffman
+{
+	/*
+	 * trained table for many small inputs: one canonical code fitted to a sample corpus,
+	 * so a coded input needs neither a histogram pass nor a table of its own.
+	 *   dictionary file: DICTIONARY_MAGIC, canonical table (CANONICAL_TAG, a code length per byte)
+	 *   coded file:      CODED_MAGIC, dictionary id (LE32), raw size (varint), payload
+	 * the id is the CRC32C of the table, a file coded with another dictionary does not decode
+	 */
+	const byte DICTIONARY_MAGIC[] = {'H', 'U', 'D', 0x1a};
+	const byte CODED_MAGIC[] = {'H', 'U', 'C', 0x1a};
+	const size_t DICTIONARY_TABLE_SIZE = 4 + ALPHABET;
+	const size_t DICTIONARY_SIZE = sizeof DICTIONARY_MAGIC + DICTIONARY_TABLE_SIZE;
+	const size_t CODED_HEADER_SIZE = sizeof CODED_MAGIC + 4; // and the raw size varint
+	const char* const CODED_SUFFIX = ".huc";
+
+	class HuffDictionary
+	{
+	public:
+		// counts of every byte in the samples; bytes they lack still get the longest codes
+		explicit HuffDictionary(const uint64_t* counts, size_t length_limit = MAX_CODE_LENGTH);
+		// contents of a dictionary file, throws HuffException unless valid
+		HuffDictionary(const byte* input, size_t size);
+		void write(vector<byte>& output) const; // appends the dictionary file
+		uint32_t id() const
+		{
+			return id_;
+		}
+		// appends a whole coded file
+		void encode(const byte* input, size_t size, vector<byte>& output) const;
+		// input is a whole coded file, throws HuffException unless it was coded with this dictionary
+		void decode(const byte* input, size_t size, vector<byte>& output) const;
+
+	private:
+		byte table_[DICTIONARY_TABLE_SIZE];
+		code_word codes_[ALPHABET];
+		size_t max_length_ = 0;
+		uint32_t id_ = 0;
+		HuffmanDecoder decoder_;
+	private:
+		void build();
+	};
+
+	// one dictionary from the bytes of all the sample files
+	HuffDictionary train_dictionary(const vector<string>& filenames, size_t length_limit = MAX_CODE_LENGTH);
+	void save_dictionary(const HuffDictionary& dictionary, const string& filename);
+	HuffDictionary load_dictionary(const string& filename);
+
+	// every file to its name + CODED_SUFFIX, threads files at once (0 means one per core);
+	// each file is read once, errors carry the name of the first file that failed
+	void compress_files(const HuffDictionary& dictionary, const vector<string>& filenames, size_t threads = 1);
+	// every file back to its name without CODED_SUFFIX, or with ".out" if it lacks it
+	void decompress_files(const HuffDictionary& dictionary, const vector<string>& filenames, size_t threads = 1);
+}
+
+
+#endif
@@ -1,14 +1,12 @@
 #include "huffman.h"
 #include <cassert>
-#include <set>
 #include <algorithm>
-#include <nmmintrin.h>
 #include <cstring>
 #include <climits>
 
 namespace huffman
 {
-	void write_int_to_byte_array(byte* x, const int value, int& end)
+	void write_int_to_byte_array(byte* x, const int value, size_t& end)
 	{
 		x[end++] = static_cast<byte>(value & 0x000000ff);
 		x[end++] = static_cast<byte>((value & 0x0000ff00) >> 8);
@@ -16,7 +14,7 @@ namespace huffman
 		x[end++] = static_cast<byte>((value & 0xff000000) >> 24);
 	}
 
-	int read_int_from_byte_array(const byte* x, const size_t& size, int& end)
+	int read_int_from_byte_array(const byte* x, const size_t& size, size_t& end)
 	{
 		assert(size - end >= 4);
 		int res = 0;
@@ -27,30 +25,185 @@ namespace huffman
 		return res;
 	}
 
-	/** TreeNode CLASS: **/
+	void write_le64(byte* x, const uint64_t value, size_t& end)
+	{
+		for (size_t i = 0; i < 8; ++i)
+			x[end++] = static_cast<byte>(value >> (8 * i));
+	}
+
+	uint64_t read_le64(const byte* x, size_t& end)
+	{
+		uint64_t res = 0;
+		for (size_t i = 0; i < 8; ++i)
+			res |= static_cast<uint64_t>(x[end++]) << (8 * i);
+		return res;
+	}
+
+	void write_varint(byte* x, uint64_t value, size_t& end)
+	{
+		for (; value >= 0x80; value >>= 7)
+			x[end++] = static_cast<byte>(value | 0x80);
+		x[end++] = static_cast<byte>(value);
+	}
+
+	bool read_varint(const byte* x, const size_t size, size_t& end, uint64_t& value)
+	{
+		uint64_t res = 0;
+		for (size_t shift = 0, it = end; shift < 64 && it < size; shift += 7)
+		{
+			const byte part = x[it++];
+			if (shift == 63 && part > 1) // more than 64 bits
+				return false;
+			res |= static_cast<uint64_t>(part & 0x7f) << shift;
+			if ((part & 0x80) == 0)
+			{
+				value = res;
+				end = it;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void canonical_codes(const byte* lengths, uint64_t* codes, const size_t alphabet)
+	{
+		size_t count[MAX_CODE_LENGTH + 1] = {};
+		for (size_t s = 0; s < alphabet; ++s)
+		{
+			assert(lengths[s] <= MAX_CODE_LENGTH);
+			++count[lengths[s]];
+		}
+		count[0] = 0;
+		uint64_t next[MAX_CODE_LENGTH + 1];
+		uint64_t code = 0;
+		next[0] = 0;
+		for (size_t len = 1; len <= MAX_CODE_LENGTH; ++len)
+		{
+			code = (code + count[len - 1]) << 1;
+			next[len] = code;
+		}
+		for (size_t s = 0; s < alphabet; ++s)
+			if (lengths[s] != 0)
+				codes[s] = next[lengths[s]]++;
+	}
+
+	bool valid_code_lengths(const byte* lengths, const size_t alphabet)
+	{
+		size_t count[MAX_CODE_LENGTH + 1] = {};
+		for (size_t s = 0; s < alphabet; ++s)
+		{
+			if (lengths[s] > MAX_CODE_LENGTH)
+				return false;
+			++count[lengths[s]];
+		}
+		size_t free = 1; // unused codes of the current length, capped above the alphabet
+		for (size_t len = 1; len <= MAX_CODE_LENGTH; ++len)
+		{
+			free = std::min(free * 2, 2 * alphabet);
+			if (count[len] > free)
+				return false;
+			free -= count[len];
+		}
+		return true;
+	}
+
+	void limit_code_lengths(const uint64_t* freqs, size_t limit, byte* lengths, const size_t alphabet)
+	{
+		vector<size_t> symbols; // rarest first
+		for (size_t s = 0; s < alphabet; ++s)
+		{
+			lengths[s] = 0;
+			if (freqs[s] != 0)
+				symbols.push_back(s);
+		}
+		std::stable_sort(symbols.begin(), symbols.end(), [freqs](const size_t a, const size_t b)
+		{
+			return freqs[a] < freqs[b];
+		});
+		const size_t n = symbols.size();
+		if (n <= 1)
+		{
+			if (n == 1)
+				lengths[symbols[0]] = 1;
+			return;
+		}
+		limit = std::min(limit, MAX_CODE_LENGTH);
+		while (limit < MAX_CODE_LENGTH && (static_cast<uint64_t>(1) << limit) < n) // n codes fit in 64 bits
+			++limit;
+
+		// item of a level: a leaf or a package of two neighbouring items of the level below;
+		// only the cheapest 2n - 2 items of a level can be chosen
+		struct item
+		{
+			uint64_t weight;
+			int symbol; // -1 for packages
+		};
+		vector<vector<item>> levels(limit);
+		for (size_t l = limit; l-- > 0;)
+		{
+			vector<item>& level = levels[l];
+			const vector<item>* below = l + 1 < limit ? &levels[l + 1] : nullptr;
+			const size_t packages = below ? below->size() / 2 : 0;
+			size_t leaf = 0, package = 0;
+			while (level.size() < 2 * n - 2 && (leaf < n || package < packages))
+			{
+				const uint64_t package_weight = package < packages
+					? (*below)[2 * package].weight + (*below)[2 * package + 1].weight : 0;
+				if (leaf < n && (package == packages || freqs[symbols[leaf]] <= package_weight))
+				{
+					level.push_back({freqs[symbols[leaf]], static_cast<int>(symbols[leaf])});
+					++leaf;
+				}
+				else
+				{
+					level.push_back({package_weight, -1});
+					++package;
+				}
+			}
+		}
+		// chosen items of a level are a prefix, its packages choose a prefix of the level below;
+		// every chosen leaf adds a bit to its code
+		size_t chosen = 2 * n - 2;
+		for (size_t l = 0; l < limit && chosen != 0; ++l)
+		{
+			size_t packages = 0;
+			for (size_t i = 0; i < chosen; ++i)
+			{
+				if (levels[l][i].symbol < 0)
+					++packages;
+				else
+					++lengths[levels[l][i].symbol];
+			}
+			chosen = 2 * packages;
+		}
+	}
 
-	bool tree_node::is_leaf() const
+	// symbols of the tree header, little endian
+	template <typename Symbol>
+	static void write_symbol(byte* x, const Symbol symb, size_t& end)
 	{
-		return !left && !right;
+		for (size_t i = 0; i < sizeof(Symbol); ++i)
+			x[end++] = static_cast<byte>(symb >> (8 * i));
 	}
 
-	shared_ptr<tree_node> node_merge(shared_ptr<tree_node>& node1, shared_ptr<tree_node>& node2)
+	template <typename Symbol>
+	static Symbol read_symbol(const byte* x)
 	{
-		auto result = std::make_shared<tree_node>(tree_node());
-		result->freq = node1->freq + node2->freq;
-		result->left = node1;
-		result->right = node2;
-		return result;
+		Symbol symb = 0;
+		for (size_t i = 0; i < sizeof(Symbol); ++i)
+			symb |= static_cast<Symbol>(x[i] << (8 * i));
+		return symb;
 	}
 
 	/************************ HuffmanEncoder CLASS: **************************************/
 
-	void HuffmanEncoder::simplify(byte* output, vector<byte>& bite_array, int& end)
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::simplify(byte* output, vector<byte>& bite_array, size_t& end)
 	{
-		for (int i = 0; i < bite_array.size(); i += 8)
+		for (size_t i = 0; i < bite_array.size(); i += 8)
 		{
 			byte val = 0;
-			for (int j = i; j < CHAR_BIT + i; ++j)
+			for (size_t j = i; j < CHAR_BIT + i; ++j)
 			{
 				const bool include = j < bite_array.size() ? bite_array[j] != 0 : 0;
 				val <<= 1;
@@ -60,271 +213,788 @@ namespace huffman
 		}
 	}
 
-	void HuffmanEncoder::append(byte* data, const size_t len)
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::append(const Symbol* data, const size_t len)
 	{
 		if (len == 0)
 			build();
-		for (size_t i = 0; i < len; ++i)
-			++freqs[data[i]];
+		uint64_t* freq = freqs.data();
+		size_t i = 0;
+		for (; i + HISTOGRAMS <= len; i += HISTOGRAMS)
+		{
+			++freq[data[i]];
+			++freq[Alphabet + data[i + 1]];
+			++freq[2 * Alphabet + data[i + 2]];
+			++freq[3 * Alphabet + data[i + 3]];
+		}
+		for (; i < len; ++i)
+			++freq[data[i]];
 	}
 
-	void HuffmanEncoder::create_bin_code(const tree_ptr cur)
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::append_counts(const uint64_t* counts)
 	{
-		if (cur->is_leaf())
-			nodes.push_back(cur->symb);
-		if (cur->left)
-		{
-			bin_tree.push_back(1);
-			create_bin_code(cur->left);
-		}
-		if (cur->right)
+		for (size_t s = 0; s < Alphabet; ++s)
+			freqs[s] += counts[s];
+	}
+
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::create_bin_code(const node cur)
+	{
+		const flat_node<Symbol, node>& n = tree[cur];
+		if (n.child[0] == NO_NODE)
+			nodes.push_back(n.symb);
+		for (const auto child : n.child)
 		{
+			if (child == NO_NODE)
+				continue;
 			bin_tree.push_back(1);
-			create_bin_code(cur->right);
+			create_bin_code(child);
 		}
 		bin_tree.push_back(0);
 	}
 
-	void HuffmanEncoder::dfs(const tree_ptr cur, vector<byte>& key)
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::build()
 	{
-		if (cur->is_leaf()) {
-			if (key.empty())
-				cur->left = std::make_shared<tree_node>(tree_node(cur->symb, cur->freq));
-			else
-				codes[cur->symb] = key;
+		symbol_array<uint64_t, Alphabet> freq;
+		symbol_array<node, Alphabet> order;
+		size_t n = 0;
+		for (size_t s = 0; s < Alphabet; ++s)
+		{
+			freq[s] = 0;
+			for (size_t h = 0; h < HISTOGRAMS; ++h)
+				freq[s] += freqs[h * Alphabet + s];
+			if (freq[s] != 0)
+				order[n++] = static_cast<node>(s);
 		}
-		if (cur->left)
+		if (n == 0) // empty input
+			return;
+		std::sort(order.data(), order.data() + n, [&freq](const node a, const node b)
+		{
+			return freq[a] < freq[b] || (freq[a] == freq[b] && a < b);
+		});
+
+		// two queues: the sorted leaves and the merged nodes, which are made in order of weight;
+		// on equal weights the leaf goes first
+		symbol_array<uint64_t, 2 * Alphabet> weight;
+		for (size_t i = 0; i < n; ++i)
 		{
-			key.push_back(0);
-			dfs(cur->left, key);
-			key.pop_back();
+			tree[i] = {{NO_NODE, NO_NODE}, static_cast<Symbol>(order[i])};
+			weight[i] = freq[order[i]];
 		}
-		if (cur->right)
+		tree_size = n;
+		size_t leaf = 0, merged = n;
+		auto take = [&]()
 		{
-			key.push_back(1);
-			dfs(cur->right, key);
-			key.pop_back();
+			if (leaf < n && (merged == tree_size || weight[leaf] <= weight[merged]))
+				return static_cast<node>(leaf++);
+			return static_cast<node>(merged++);
+		};
+		while (tree_size < 2 * n - 1)
+		{
+			const node left = take();
+			const node right = take();
+			tree[tree_size] = {{left, right}, 0};
+			weight[tree_size++] = weight[left] + weight[right];
+		}
+		if (n == 1) // a single symbol still takes one bit
+			tree[tree_size++] = {{0, NO_NODE}, 0};
+		root = static_cast<node>(tree_size - 1);
+
+		// parents come after their children, so one backward pass gives all codes
+		symbol_array<uint64_t, 2 * Alphabet> bits;
+		symbol_array<size_t, 2 * Alphabet> depth;
+		bits[root] = 0;
+		depth[root] = 0;
+		max_length = 0;
+		for (size_t i = tree_size; i-- > 0;)
+		{
+			const flat_node<Symbol, node>& cur = tree[i];
+			if (cur.child[0] == NO_NODE)
+			{
+				assert(depth[i] <= MAX_CODE_LENGTH);
+				codes[cur.symb].bits = bits[i];
+				codes[cur.symb].length = depth[i];
+				max_length = std::max(max_length, depth[i]);
+				continue;
+			}
+			for (size_t d = 0; d < 2; ++d)
+			{
+				if (cur.child[d] == NO_NODE)
+					continue;
+				bits[cur.child[d]] = (bits[i] << 1) | d;
+				depth[cur.child[d]] = depth[i] + 1;
+			}
 		}
+		if (max_length > length_limit)
+			limit_lengths(freq.data());
+		if (mode == CANONICAL_CODES)
+			make_canonical();
+		coded_bits = 0;
+		for (size_t s = 0; s < Alphabet; ++s)
+			coded_bits += freq[s] * codes[s].length;
+		if (std::is_same<Symbol, byte>::value && max_length <= JOIN_CODE_BITS)
+			for (size_t s = 0; s < ALPHABET; ++s)
+				join_table[s] = static_cast<uint32_t>(codes[s].bits << 8 | codes[s].length);
 	}
 
-	void HuffmanEncoder::build()
+	// replaces the codes and the tree with canonical codes of at most length_limit bits
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::limit_lengths(const uint64_t* freq)
 	{
-		if (freqs.empty()) // empty input
-			return;
-		std::multiset<tree_ptr, set_comp> groups;
-		size_t it_node = 0;
-		for (const auto p : freqs)
+		symbol_array<byte, Alphabet> lengths;
+		limit_code_lengths(freq, length_limit, lengths.data(), Alphabet);
+		symbol_array<uint64_t, Alphabet> canonical;
+		canonical_codes(lengths.data(), canonical.data(), Alphabet);
+		tree[0] = {{NO_NODE, NO_NODE}, 0};
+		tree_size = 1;
+		root = 0;
+		max_length = 0;
+		limit_bits = 0;
+		for (size_t s = 0; s < Alphabet; ++s)
 		{
-			const auto node = std::make_shared<tree_node>(tree_node(p.first, p.second));
-			groups.insert(node);
+			if (lengths[s] == 0)
+				continue;
+			limit_bits += freq[s] * lengths[s] - freq[s] * codes[s].length;
+			codes[s].bits = canonical[s];
+			codes[s].length = lengths[s];
+			max_length = std::max(max_length, codes[s].length);
+			node cur = root;
+			for (size_t i = lengths[s]; i-- > 0;)
+			{
+				node& next = tree[cur].child[(canonical[s] >> i) & 1];
+				if (next == NO_NODE)
+				{
+					next = static_cast<node>(tree_size);
+					tree[tree_size++] = {{NO_NODE, NO_NODE}, 0};
+				}
+				cur = next;
+			}
+			tree[cur].symb = static_cast<Symbol>(s);
 		}
+	}
 
-		while (groups.size() > 1)
-		{
-			tree_ptr tree1 = *groups.begin();
-			groups.erase(groups.begin());
-
-			tree_ptr tree2 = *groups.begin();
-			groups.erase(groups.begin());
-
-			groups.insert(node_merge(tree1, tree2));
-		}
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::make_canonical()
+	{
+		symbol_array<byte, Alphabet> lengths;
+		for (size_t s = 0; s < Alphabet; ++s)
+			lengths[s] = static_cast<byte>(codes[s].length);
+		symbol_array<uint64_t, Alphabet> canonical;
+		canonical_codes(lengths.data(), canonical.data(), Alphabet);
+		for (size_t s = 0; s < Alphabet; ++s)
+			codes[s].bits = canonical[s];
+	}
 
-		tree = *groups.begin();
-		vector<byte> key;
-		dfs(tree, key); // generate codes
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::encode(const Symbol* input, const size_t len, vector<byte>& output)
+	{
+		output.clear();
+		output.resize(max_encoded_size(len));
+		output.resize(encode(input, len, output.data(), output.size()));
 	}
 
-	inline void HuffmanEncoder::compression(vector<byte>& input, vector<byte>& output)
+	template <typename Symbol, size_t Alphabet>
+	size_t BasicHuffmanEncoder<Symbol, Alphabet>::encode(const Symbol* input, const size_t len, byte* output, const size_t capacity)
 	{
-		const size_t new_size = (input.size() + 7) / 8;
-		byte* compress = new byte[new_size];
-		int end = 0;
-		simplify(compress, input, end);
-		for (int j = 0; j < end; ++j)
-			output.push_back(compress[j]);
-		input.clear();
-		delete[] compress;
+		writer.reset(output);
+		size_t i = 0;
+		for (;;)
+		{
+			const uint64_t used = static_cast<uint64_t>(writer.position() - output) * CHAR_BIT + writer.pending();
+			if (used > static_cast<uint64_t>(capacity) * CHAR_BIT)
+				return NO_ROOM;
+			if (i == len)
+				break;
+			// symbols that fit whatever their codes, then one at a time near the end
+			const uint64_t room = static_cast<uint64_t>(capacity) * CHAR_BIT - used;
+			size_t count = static_cast<size_t>(std::min<uint64_t>(len - i, room / std::max<size_t>(max_length, 1)));
+			if (count == 0)
+			{
+				if (codes[input[i]].length > room)
+					return NO_ROOM;
+				count = 1;
+			}
+			put_symbols(input + i, count);
+			i += count;
+		}
+		if (len == 0)
+			writer.flush();
+		return writer.position() - output;
 	}
 
-	void HuffmanEncoder::encode(byte* input, const size_t len, vector<byte>& output)
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::encode_interleaved(const Symbol* input, const size_t len, vector<byte>& output)
 	{
+		const size_t segment = (len + STREAMS - 1) / STREAMS;
 		output.clear();
-		if (len == 0)
+		output.resize(JUMP_TABLE_SIZE + STREAMS * bit_writer::max_size(segment, max_length));
+		size_t end = 0;
+		byte* stream = output.data() + JUMP_TABLE_SIZE;
+		for (size_t k = 0; k < STREAMS; ++k)
 		{
-			compression(buf, output);
-			return;
+			const size_t begin = std::min(k * segment, len);
+			writer.reset(stream);
+			put_symbols(input + begin, std::min(segment, len - begin));
+			writer.flush();
+			if (k + 1 < STREAMS)
+				write_le64(output.data(), writer.position() - stream, end);
+			stream = writer.position();
 		}
+		output.resize(stream - output.data());
+	}
 
-		for (size_t i = 0; i < len; ++i)
+	template <typename Symbol, size_t Alphabet>
+	inline void BasicHuffmanEncoder<Symbol, Alphabet>::put_symbols(const Symbol* input, const size_t len)
+	{
+		size_t i = 0;
+		if (std::is_same<Symbol, byte>::value && max_length <= JOIN_CODE_BITS)
 		{
-			assert(codes.find(input[i]) != codes.end());
-			for (auto val : codes[input[i]])
+			// bytes with short codes go JOIN_SYMBOLS codes a put
+			const size_t batch = 64;
+			uint64_t joined[batch];
+			byte lengths[batch];
+			for (; i + batch * JOIN_SYMBOLS <= len; i += batch * JOIN_SYMBOLS)
 			{
-				buf.push_back(val);
-				if (buf.size() == CHAR_BIT * BUFFER)
-				{
-					compression(buf, output);
-				}
+				join_codes(reinterpret_cast<const byte*>(input + i), batch, join_table, joined, lengths);
+				for (size_t g = 0; g < batch; ++g)
+					writer.put(joined[g], lengths[g]);
 			}
 		}
+		for (; i < len; ++i)
+		{
+			const code_word& code = codes[input[i]];
+			assert(code.length != 0);
+			writer.put(code.bits, code.length);
+		}
 	}
 
 
-	void HuffmanEncoder::write_tree(byte*& output, size_t& size)
+	template <typename Symbol, size_t Alphabet>
+	size_t BasicHuffmanEncoder<Symbol, Alphabet>::header_size()
 	{
-		if (bin_tree.empty() && tree) // if not created yet
-			create_bin_code(tree);
+		if (mode == CANONICAL_CODES) // code lengths only, fixed size
+			return 4 + Alphabet;
+		if (bin_tree.empty() && tree_size != 0) // if not created yet
+			create_bin_code(root);
 		//int64_t: 64 / 8 = 8 bite
-		const int simp_tree = (bin_tree.size() + 7) / 8;
-		size = 4 + nodes.size() + 4 + simp_tree;
+		return 4 + nodes.size() * sizeof(Symbol) + 4 + (bin_tree.size() + 7) / 8;
+	}
+
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::write_tree(byte*& output, size_t& size)
+	{
+		size = header_size();
 		output = new byte[size];
-		int end = 0;
+		write_header(output, size);
+	}
 
+	template <typename Symbol, size_t Alphabet>
+	size_t BasicHuffmanEncoder<Symbol, Alphabet>::write_header(byte* output, const size_t capacity)
+	{
+		const size_t size = header_size();
+		if (size > capacity)
+			return NO_ROOM;
+		size_t end = 0;
+		if (mode == CANONICAL_CODES)
+		{
+			write_int_to_byte_array(output, static_cast<int>(Alphabet + 1), end); // CANONICAL_TAG for bytes
+			for (size_t s = 0; s < Alphabet; ++s)
+				output[end++] = static_cast<byte>(codes[s].length);
+			return size;
+		}
+		const size_t simp_tree = (bin_tree.size() + 7) / 8;
 		write_int_to_byte_array(output, static_cast<int>(nodes.size()), end);
-		for (const auto node : nodes)
-			output[end++] = node;
+		for (const auto symb : nodes)
+			write_symbol(output, symb, end);
 
-		write_int_to_byte_array(output, simp_tree, end);
+		write_int_to_byte_array(output, static_cast<int>(simp_tree), end);
 
 		simplify(output, bin_tree, end);
+		return size;
 	}
 
 
 	/************************ HuffmanDecoder CLASS: **************************************/
 
-	void HuffmanDecoder::update(const byte move)
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanDecoder<Symbol, Alphabet>::update(const byte move)
 	{
-		if (q.empty())
-			q.push(tree_);
+		if (!valid_)
+			return;
+		if (path_size_ == 0)
+			path_[path_size_++] = 0;
 
 		for (int i = CHAR_BIT - 1; i >= 0; --i)
 			if ((move & (1 << i)) != 0) {
-				assert(!q.empty());
-				if (!q.top()->left)
+				if (path_size_ == 0) // a node after the tree was closed
 				{
-					q.top()->left = std::make_shared<tree_node>(tree_node());
-					q.push(q.top()->left);
+					valid_ = false;
+					return;
 				}
-				else
+				if (tree_size_ == 2 * Alphabet) // more nodes than any code has
 				{
-					q.top()->right = std::make_shared<tree_node>(tree_node());
-					q.push(q.top()->right);
+					valid_ = false;
+					return;
 				}
+				const node top = path_[path_size_ - 1];
+				const node added = static_cast<node>(tree_size_++);
+				child_[child_[0][top] == 0 ? 0 : 1][top] = added;
+				path_[path_size_++] = added;
 			}
 			else
 			{
-				if (q.empty())
+				if (path_size_ == 0)
 					break;
 
-				if (q.top()->is_leaf())
-					q.top()->symb = nodes[it_nodes++];
-				q.pop();
+				const node top = path_[--path_size_];
+				if (is_leaf(top) && it_nodes < nodes_size / sizeof(Symbol))
+					symb_[top] = read_symbol<Symbol>(&nodes[sizeof(Symbol) * it_nodes++]);
 			}
 	}
 
-	void HuffmanDecoder::build(const byte* stream, const size_t& size)
+	// true once all 4 bytes of the field are in, possibly over several chunks
+	template <typename Symbol, size_t Alphabet>
+	bool BasicHuffmanDecoder<Symbol, Alphabet>::read_field(const byte* stream, const size_t size, size_t& it, int& value)
 	{
-		/*while (it_ < size_prev)
+		while (field_size_ < sizeof field_ && it < size)
+			field_[field_size_++] = stream[it++];
+		if (field_size_ < sizeof field_)
+			return false;
+		size_t end = 0;
+		value = read_int_from_byte_array(field_, sizeof field_, end);
+		field_size_ = 0;
+		return true;
+	}
+
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanDecoder<Symbol, Alphabet>::build(const byte* stream, const size_t size)
+	{
+		size_t it = 0;
+		while (it < size)
 		{
 			if (cnt_nodes == -1)
-				cnt_nodes = read_int_from_byte_array(input_prev, it_);
-
+			{
+				if (!read_field(stream, size, it, cnt_nodes))
+					continue;
+				if (cnt_nodes == static_cast<int>(Alphabet + 1)) // CANONICAL_TAG for bytes
+				{
+					canonical_ = true;
+					cnt_nodes = Alphabet;
+				}
+				else if (cnt_nodes > 0) // symbol count to bytes
+					cnt_nodes = static_cast<int>(std::min<int64_t>(static_cast<int64_t>(cnt_nodes) * sizeof(Symbol), INT_MAX));
+			}
 			else if (cnt_nodes > 0)
-				nodes.push_back(input_prev[it_++]), cnt_nodes--;
+			{
+				const size_t count = std::min(static_cast<size_t>(cnt_nodes), size - it);
+				const size_t kept = std::min(count, Alphabet * sizeof(Symbol) - nodes_size); // the rest is no valid tree
+				memcpy(nodes.data() + nodes_size, stream + it, kept);
+				nodes_size += kept;
+				cnt_nodes -= static_cast<int>(count);
+				it += count;
+			}
+
+			else if (canonical_) // nothing follows the code lengths
+				it = size;
 
 			else if (cnt_bytes == -1)
-				cnt_bytes = read_int_from_byte_array(input_prev, it_);
+				read_field(stream, size, it, cnt_bytes);
 
 			else
-				update(input_prev[it_++]);
-		}*/
-		while (it_ < size_prev)
+				update(stream[it++]);
+		}
+	}
+
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanDecoder<Symbol, Alphabet>::build_canonical()
+	{
+		assert(nodes_size == Alphabet);
+		std::fill(len_count_, len_count_ + MAX_CODE_LENGTH + 1, 0);
+		for (size_t s = 0; s < Alphabet; ++s)
 		{
-			if (cnt_nodes == -1)
+			assert(nodes[s] <= MAX_CODE_LENGTH);
+			++len_count_[nodes[s]];
+			max_length_ = std::max(max_length_, static_cast<size_t>(nodes[s]));
+		}
+		len_count_[0] = 0;
+
+		uint64_t code = 0;
+		size_t index = 0;
+		first_code_[0] = 0;
+		first_index_[0] = 0;
+		for (size_t len = 1; len <= MAX_CODE_LENGTH; ++len)
+		{
+			code = (code + len_count_[len - 1]) << 1;
+			first_code_[len] = code;
+			first_index_[len] = index;
+			index += len_count_[len];
+		}
+
+		size_t next[MAX_CODE_LENGTH + 1];
+		std::copy(first_index_, first_index_ + MAX_CODE_LENGTH + 1, next);
+		for (size_t s = 0; s < Alphabet; ++s)
+			if (nodes[s] != 0)
+				sorted_[next[nodes[s]]++] = static_cast<Symbol>(s);
+	}
+
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanDecoder<Symbol, Alphabet>::build_table()
+	{
+		const size_t table_size = static_cast<size_t>(1) << TABLE_BITS;
+		// symbol whose code is a prefix of the index and the code length, 0 for long codes
+		vector<pair<Symbol, byte>> first(table_size, pair<Symbol, byte>(0, 0));
+		if (canonical_)
+		{
+			if (max_length_ == 0) // empty code
+				return;
+			symbol_array<uint64_t, Alphabet> codes;
+			canonical_codes(nodes.data(), codes.data(), Alphabet);
+			for (size_t s = 0; s < Alphabet; ++s)
 			{
-				cnt_nodes = read_int_from_byte_array(stream, size, it_);
+				const size_t len = nodes[s];
+				if (len == 0 || len > TABLE_BITS)
+					continue;
+				const size_t begin = codes[s] << (TABLE_BITS - len);
+				const size_t end = (codes[s] + 1) << (TABLE_BITS - len);
+				for (size_t idx = begin; idx < end; ++idx)
+					first[idx] = pair<Symbol, byte>(static_cast<Symbol>(s), static_cast<byte>(len));
 			}
-			else if (cnt_nodes > 0)
+		}
+		else
+		{
+			if (is_leaf(0)) // empty tree
+				return;
+			for (size_t idx = 0; idx < table_size; ++idx)
 			{
-				assert(size - it_ >= 0);
-				nodes.push_back(stream[it_++]), cnt_nodes--;
+				node cur = 0;
+				for (size_t i = 0; i < TABLE_BITS; ++i)
+				{
+					cur = child_[(idx >> (TABLE_BITS - 1 - i)) & 1][cur];
+					if (cur == 0)
+						break;
+					if (is_leaf(cur))
+					{
+						first[idx] = pair<Symbol, byte>(symb_[cur], static_cast<byte>(i + 1));
+						break;
+					}
+				}
 			}
+		}
 
-			else if (cnt_bytes == -1)
-				cnt_bytes = read_int_from_byte_array(stream, size, it_);
+		table_.assign(table_size, table_entry<Symbol>());
+		min_length_ = TABLE_BITS + 1;
+		for (size_t idx = 0; idx < table_size; ++idx)
+		{
+			table_entry<Symbol>& entry = table_[idx];
+			size_t used = 0;
+			while (entry.count < TABLE_SYMBOLS)
+			{
+				const auto& next = first[(idx << used) & (table_size - 1)];
+				if (next.second == 0 || used + next.second > TABLE_BITS)
+					break;
+				entry.symb[entry.count++] = next.first;
+				used += next.second;
+			}
+			entry.bits = static_cast<byte>(used);
+			entry.first = first[idx].second;
+			if (entry.count != 0)
+				min_length_ = std::min(min_length_, static_cast<size_t>(first[idx].second));
+		}
+	}
 
-			else
+	template <typename Symbol, size_t Alphabet>
+	inline bool BasicHuffmanDecoder<Symbol, Alphabet>::in_code() const
+	{
+		return canonical_ ? code_length_ != 0 : it_tree_ != 0;
+	}
+
+	template <typename Symbol, size_t Alphabet>
+	inline void BasicHuffmanDecoder<Symbol, Alphabet>::decode_bit(const bool key, Symbol*& output)
+	{
+		if (canonical_)
+		{
+			code_ = (code_ << 1) | (key ? 1 : 0);
+			++code_length_;
+			const uint64_t offset = code_ - first_code_[code_length_];
+			if (offset < len_count_[code_length_])
 			{
-				assert(size - it_ >= 0);
-				update(stream[it_++]);
+				*output++ = sorted_[first_index_[code_length_] + offset];
+				code_ = 0;
+				code_length_ = 0;
 			}
+			else if (code_length_ >= max_length_) // no such code, restart
+			{
+				code_ = 0;
+				code_length_ = 0;
+			}
+			return;
+		}
+		it_tree_ = child_[key ? 1 : 0][it_tree_]; // no such code restarts from the root
+		if (it_tree_ != 0 && is_leaf(it_tree_))
+		{
+			*output++ = symb_[it_tree_];
+			it_tree_ = 0;
 		}
-		it_ -= size_prev;
 	}
 
-	void HuffmanDecoder::decode_bit(const bool key, vector<byte>& output)
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanDecoder<Symbol, Alphabet>::append(const byte* input, const size_t size)
 	{
-		if (key == false)
-			it_tree_ = it_tree_->left;
-		else
-			it_tree_ = it_tree_->right;
-		if (it_tree_->is_leaf())
+		if (size == 0)
 		{
-			output.push_back(it_tree_->symb);
-			it_tree_ = tree_;
+			if (canonical_ && (nodes_size != Alphabet || !valid_code_lengths(nodes.data(), Alphabet)))
+				valid_ = false;
+			if (!valid_)
+				return;
+			if (canonical_)
+				build_canonical();
+			build_table();
+			return;
 		}
+		build(input, size);
 	}
 
-	void HuffmanDecoder::create(const byte* input, const size_t& size)
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanDecoder<Symbol, Alphabet>::decode(const byte* input, const size_t size, vector<Symbol>& output)
 	{
-		delete[] input_prev;
-		size_prev = size;
-		input_prev = new byte[size_prev];
-		memcpy(input_prev, input, size_prev);
+		output.clear();
+		if (size == 0 || table_.empty())
+			return;
+		// every symbol takes at least min_length_ bits
+		output.resize(size * CHAR_BIT / min_length_ + TABLE_SYMBOLS);
+		output.resize(decode(input, size, output.data(), output.size()));
 	}
 
+	template <typename Symbol, size_t Alphabet>
+	size_t BasicHuffmanDecoder<Symbol, Alphabet>::decode(const byte* input, const size_t size, Symbol* output, const size_t capacity)
+	{
+		if (size == 0 || table_.empty())
+			return 0;
+		Symbol* out = output;
+		Symbol* const out_end = output + capacity;
+
+		bit_reader reader;
+		reader.reset(input, size);
+		auto walk = [&]() // decode bit by bit until the current code ends, maybe in the next chunk
+		{
+			do
+			{
+				reader.refill();
+				if (reader.count() == 0)
+					return;
+				decode_bit((reader.peek() >> 63) != 0, out);
+				reader.consume(1);
+			} while (in_code());
+		};
+
+		if (in_code() && out != out_end) // code started in the previous chunk
+			walk();
+		// a refill has bits for several table steps, each writes TABLE_SYMBOLS at once
+		for (;;)
+		{
+			reader.refill();
+			size_t rounds = std::min(reader.count() / TABLE_BITS, static_cast<size_t>(out_end - out) / TABLE_SYMBOLS);
+			if (rounds == 0)
+				break;
+			for (; rounds > 0; --rounds)
+			{
+				const table_entry<Symbol>& entry = table_[reader.peek() >> (64 - TABLE_BITS)];
+				if (entry.count == 0) // long code
+				{
+					walk();
+					break;
+				}
+				memcpy(out, entry.symb, sizeof entry.symb);
+				out += entry.count;
+				reader.consume(entry.bits);
+			}
+		}
+		for (;;) // the last few symbols and a tail shorter than a table index go bit by bit
+		{
+			reader.refill();
+			if (reader.count() == 0 || out == out_end)
+				break;
+			walk();
+		}
+		return out - output;
+	}
 
-	void HuffmanDecoder::append(byte* input, const size_t size)
+	// one code bit by bit, false if the stream ends first or has no such code
+	template <typename Symbol, size_t Alphabet>
+	bool BasicHuffmanDecoder<Symbol, Alphabet>::decode_long(bit_reader& reader, Symbol*& output) const
 	{
-		if (size == 0)
+		uint64_t code = 0;
+		size_t length = 0;
+		node cur = 0;
+		for (;;)
 		{
-			build(input_prev, size_prev);
-			return;
+			reader.refill();
+			if (reader.count() == 0)
+				return false;
+			const size_t key = reader.peek() >> 63;
+			reader.consume(1);
+			++length;
+			if (canonical_)
+			{
+				code = (code << 1) | key;
+				const uint64_t offset = code - first_code_[length];
+				if (offset < len_count_[length])
+				{
+					*output++ = sorted_[first_index_[length] + offset];
+					return true;
+				}
+				if (length >= max_length_)
+					return false;
+			}
+			else
+			{
+				cur = child_[key][cur]; // children always have larger indices, so this ends
+				if (cur == 0)
+					return false;
+				if (is_leaf(cur))
+				{
+					*output++ = symb_[cur];
+					return true;
+				}
+			}
 		}
-		if (size_prev == 0)
+	}
+
+	template <typename Symbol, size_t Alphabet>
+	bool BasicHuffmanDecoder<Symbol, Alphabet>::decode_symbol(bit_reader& reader, Symbol& symbol) const
+	{
+		if (table_.empty())
+			return false;
+		reader.refill();
+		const table_entry<Symbol>& entry = table_[reader.peek() >> (64 - TABLE_BITS)];
+		if (entry.count != 0 && entry.first <= reader.count())
 		{
-			create(input, size);
-			size_prev = size;
-			return;
+			symbol = entry.symb[0];
+			reader.consume(entry.first);
+			return true;
 		}
-		byte* stream = new byte[size + size_prev];
-		for (auto i = 0; i < size_prev; ++i)
-			stream[i] = input_prev[i];
-		for (auto i = 0; i < size; ++i)
-			stream[i + size_prev] = input[i];
-		build(stream, size + size_prev);
-		delete[] stream;
-		create(input, size);
+		Symbol* output = &symbol;
+		return decode_long(reader, output);
 	}
 
-	void HuffmanDecoder::decode(byte* input, const size_t size, vector<byte>& output)
+	template <typename Symbol, size_t Alphabet>
+	bool BasicHuffmanDecoder<Symbol, Alphabet>::decode_interleaved(const byte* input, const size_t size, Symbol* output, const size_t output_size) const
 	{
-		output.clear();
-		for (size_t t = 0; t < size; ++t)
+		if (size < JUMP_TABLE_SIZE)
+			return false;
+		bit_reader readers[STREAMS];
+		Symbol* out[STREAMS];
+		Symbol* end[STREAMS];
+		const size_t segment = (output_size + STREAMS - 1) / STREAMS;
+		size_t header = 0, begin = JUMP_TABLE_SIZE;
+		for (size_t k = 0; k < STREAMS; ++k)
+		{
+			const uint64_t length = k + 1 < STREAMS ? read_le64(input, header) : size - begin;
+			if (length > size - begin)
+				return false;
+			readers[k].reset(input + begin, length);
+			begin += length;
+			out[k] = output + std::min(k * segment, output_size);
+			end[k] = output + std::min((k + 1) * segment, output_size);
+		}
+		if (output_size != 0 && table_.empty())
+			return false;
+
+		// all streams step together, so their lookups do not wait on each other;
+		// a refill leaves enough bits for this many steps
+		const size_t rounds = 56 / TABLE_BITS;
+		for (;;)
 		{
-			const auto cur = input[t];
-			for (int i = CHAR_BIT - 1; i >= 0; --i)
+			bool room = true;
+			for (size_t k = 0; k < STREAMS; ++k)
 			{
-				decode_bit((cur & (1 << i)) != 0, output);
+				readers[k].refill();
+				room &= readers[k].count() >= rounds * TABLE_BITS
+					&& static_cast<size_t>(end[k] - out[k]) >= rounds * TABLE_SYMBOLS;
+			}
+			if (!room)
+				break;
+			bool long_code = false; // its stream may be short of bits for the next rounds
+			for (size_t r = 0; r < rounds && !long_code; ++r)
+			{
+				for (size_t k = 0; k < STREAMS; ++k)
+				{
+					const table_entry<Symbol>& entry = table_[readers[k].peek() >> (64 - TABLE_BITS)];
+					if (entry.count == 0)
+					{
+						if (!decode_long(readers[k], out[k]))
+							return false;
+						long_code = true;
+						continue;
+					}
+					memcpy(out[k], entry.symb, sizeof entry.symb);
+					out[k] += entry.count;
+					readers[k].consume(entry.bits);
+				}
 			}
 		}
+		for (size_t k = 0; k < STREAMS; ++k) // the ends of the streams
+			if (!decode_rest(readers[k], out[k], end[k]))
+				return false;
+		return true;
 	}
 
-	void HuffmanEncoder::clear()
+	template <typename Symbol, size_t Alphabet>
+	bool BasicHuffmanDecoder<Symbol, Alphabet>::decode_stream(const byte* input, const size_t size, Symbol* output, const size_t output_size) const
 	{
-		tree.reset();
-		codes.clear();
-		freqs.clear();
+		if (output_size != 0 && table_.empty())
+			return false;
+		bit_reader reader;
+		reader.reset(input, size);
+		return decode_rest(reader, output, output + output_size);
 	}
+
+	template <typename Symbol, size_t Alphabet>
+	bool BasicHuffmanDecoder<Symbol, Alphabet>::decode_rest(bit_reader& reader, Symbol* output, Symbol* const end) const
+	{
+		while (output != end)
+		{
+			reader.refill();
+			// a refill has bits for several table steps, then one step with all the checks
+			size_t rounds = std::min(reader.count() / TABLE_BITS, static_cast<size_t>(end - output) / TABLE_SYMBOLS);
+			for (; rounds > 0; --rounds)
+			{
+				const table_entry<Symbol>& entry = table_[reader.peek() >> (64 - TABLE_BITS)];
+				if (entry.count == 0)
+					break;
+				memcpy(output, entry.symb, sizeof entry.symb);
+				output += entry.count;
+				reader.consume(entry.bits);
+			}
+			if (output == end)
+				break;
+			reader.refill();
+			const table_entry<Symbol>& entry = table_[reader.peek() >> (64 - TABLE_BITS)];
+			if (entry.count == 0 || entry.bits > reader.count() || entry.count > static_cast<size_t>(end - output))
+			{
+				if (!decode_long(reader, output))
+					return false;
+				continue;
+			}
+			for (size_t i = 0; i < entry.count; ++i)
+				*output++ = entry.symb[i];
+			reader.consume(entry.bits);
+		}
+		return true;
+	}
+
+	template <typename Symbol, size_t Alphabet>
+	void BasicHuffmanEncoder<Symbol, Alphabet>::clear()
+	{
+		tree_size = 0;
+		std::fill(codes.data(), codes.data() + Alphabet, code_word());
+		std::fill(freqs.data(), freqs.data() + HISTOGRAMS * Alphabet, 0);
+	}
+
+	template class BasicHuffmanEncoder<byte, ALPHABET>;
+	template class BasicHuffmanDecoder<byte, ALPHABET>;
+	template class BasicHuffmanEncoder<wide_symbol, WIDE_ALPHABET>;
+	template class BasicHuffmanDecoder<wide_symbol, WIDE_ALPHABET>;
 }
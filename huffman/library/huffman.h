@@ -4,94 +4,190 @@
 
 #include <memory>
 #include <cstddef>
+#include <climits>
 #include <fstream>
 #include <string>
-#include <set>
-#include <map>
 #include <vector>
-#include <deque>
-#include <bitset>
-#include <stack>
+#include <cstdint>
+#include <type_traits>
+#include "bitstream.h"
+#include "kernels.h"
 
 using std::vector;
-using std::map;
 using std::pair;
 using std::string;
-using std::shared_ptr;
-using std::stack;
 
 namespace huffman
 {
 	const size_t BUFFER = 1000;
+	// returned by the caller buffer codecs when the output does not fit
+	const size_t NO_ROOM = SIZE_MAX;
+	const size_t ALPHABET = 256;
+	const size_t MAX_CODE_LENGTH = 64;
+	const size_t HISTOGRAMS = 4;
+	// tree header starting with this node count carries code lengths only
+	const int CANONICAL_TAG = ALPHABET + 1;
+
+	enum code_mode { TREE_CODES, CANONICAL_CODES };
 
 	typedef unsigned char byte;
-	void write_int_to_byte_array(byte* x, const int value, int& end);
-	int read_int_from_byte_array(byte* x, const size_t& size, int& end);
+	void write_int_to_byte_array(byte* x, const int value, size_t& end);
+	int read_int_from_byte_array(const byte* x, const size_t& size, size_t& end);
+	void write_le64(byte* x, uint64_t value, size_t& end);
+	uint64_t read_le64(const byte* x, size_t& end);
+	// LEB128: 7 bits per byte from the lowest, the top bit set on all but the last byte
+	const size_t MAX_VARINT_SIZE = 10;
+	void write_varint(byte* x, uint64_t value, size_t& end);
+	// false unless x holds a whole varint of at most 64 bits before size
+	bool read_varint(const byte* x, size_t size, size_t& end, uint64_t& value);
+	// codes ordered by length, then by symbol; lengths[s] == 0 for unused symbols
+	void canonical_codes(const byte* lengths, uint64_t* codes, size_t alphabet = ALPHABET);
+	// lengths up to MAX_CODE_LENGTH that form a prefix code
+	bool valid_code_lengths(const byte* lengths, size_t alphabet = ALPHABET);
+	// optimal code lengths of at most limit bits (package-merge), raised to fit the used symbols
+	void limit_code_lengths(const uint64_t* freqs, size_t limit, byte* lengths, size_t alphabet = ALPHABET);
+
+	// 16-bit tokens, e.g. log templates or delta coded integers
+	typedef uint16_t wide_symbol;
+	const size_t WIDE_ALPHABET = 1 << 16;
 
-	class tree_node
+	// per symbol or per node table: an array in the object for bytes,
+	// on the heap for wide alphabets, so codecs still fit on the stack
+	template <typename T, size_t N, bool Inline = (N * sizeof(T) <= (64 << 10))>
+	struct symbol_array
 	{
-	public:
-		byte symb;
-		size_t freq;
-		bool is_leaf() const;
-		shared_ptr<tree_node> left, right;
+		T data_[N];
 
-		tree_node() : symb(0), freq(0)
-		{
-		};
-		tree_node(tree_node const&) = default;
+		T* data() { return data_; }
+		const T* data() const { return data_; }
+		T& operator[](size_t i) { return data_[i]; }
+		const T& operator[](size_t i) const { return data_[i]; }
+	};
 
-		tree_node(const byte symb, const size_t freq) : symb(symb), freq(freq)
-		{
-		};
-		friend shared_ptr<tree_node> node_merge(shared_ptr<tree_node>& node1,
-		                                        shared_ptr<tree_node>& node2);
+	template <typename T, size_t N>
+	struct symbol_array<T, N, false>
+	{
+		vector<T> data_ = vector<T>(N);
+
+		T* data() { return data_.data(); }
+		const T* data() const { return data_.data(); }
+		T& operator[](size_t i) { return data_[i]; }
+		const T& operator[](size_t i) const { return data_[i]; }
 	};
 
-	shared_ptr<tree_node> node_merge(shared_ptr<tree_node>& node1, shared_ptr<tree_node>& node2);
+	// index into a tree of the alphabet, which has less than 2 * Alphabet nodes
+	template <size_t Alphabet>
+	struct node_index
+	{
+		typedef typename std::conditional<(2 * Alphabet < UINT16_MAX), uint16_t, uint32_t>::type type;
+	};
 
-	typedef shared_ptr<tree_node> tree_ptr;
+	// encoder tree node, children are indices into the node array
+	template <typename Symbol, typename Node>
+	struct flat_node
+	{
+		Node child[2]; // NO_NODE in child[0] marks a leaf
+		Symbol symb;
+	};
 
-	struct set_comp
+	struct code_word
 	{
-		bool operator()(const tree_ptr& lhs, const tree_ptr& rhs) const
-		{
-			return lhs->freq < rhs->freq;
-		}
+		uint64_t bits;
+		size_t length;
 	};
 
-	class HuffmanDecoder
+	// decode table: TABLE_BITS of the stream -> up to TABLE_SYMBOLS symbols
+	const size_t TABLE_BITS = 11;
+	const size_t TABLE_SYMBOLS = 4;
+
+	template <typename Symbol>
+	struct table_entry
+	{
+		Symbol symb[TABLE_SYMBOLS];
+		byte count; // 0 if the first code is longer than TABLE_BITS
+		byte bits;  // bits used by the symbols in the entry
+		byte first; // bits used by symb[0]
+	};
+
+	// interleaved mode: the input is cut into STREAMS equal parts coded as separate streams,
+	// the sizes of all but the last stream (LE64) go first
+	const size_t STREAMS = 4;
+	const size_t JUMP_TABLE_SIZE = (STREAMS - 1) * 8;
+
+	// symbols below Alphabet; the tree header stores them as LE, the canonical one a length byte each
+	template <typename Symbol, size_t Alphabet>
+	class BasicHuffmanDecoder
 		//       (byte*)
 		//   
 		// decode
 	{
 	private:
+		typedef typename node_index<Alphabet>::type node;
+		// the header is parsed as it comes, an int field split between chunks waits in field_
 		int cnt_bytes = -1;
-		int cnt_nodes = -1;
-		vector<byte> nodes;
-		int it_ = 0;
-		byte* input_prev = nullptr;
-		size_t size_prev = 0;
-		stack<tree_ptr> q;
-		int it_nodes = 0;
-		tree_ptr tree_ = std::make_shared<tree_node>(tree_node());
-		tree_ptr it_tree_ = tree_;
+		int cnt_nodes = -1; // header bytes left of the symbols or code lengths
+		byte field_[4];
+		size_t field_size_ = 0;
+		symbol_array<byte, Alphabet * sizeof(Symbol)> nodes = {};
+		size_t nodes_size = 0;
+		size_t it_nodes = 0;
+		// tree as index arrays with the root at 0, so child 0 means no child
+		symbol_array<node, 2 * Alphabet> child_[2] = {};
+		symbol_array<Symbol, 2 * Alphabet> symb_ = {};
+		size_t tree_size_ = 1;
+		node it_tree_ = 0;
+		// nodes from the root to the one the tree header is at
+		symbol_array<node, 2 * Alphabet> path_;
+		size_t path_size_ = 0;
+		vector<table_entry<Symbol>> table_;
+		size_t min_length_ = 1;
+		// canonical mode: nodes holds code lengths, codes are decoded by length
+		bool canonical_ = false;
+		bool valid_ = true; // false once the header read is no code
+		size_t max_length_ = 0;
+		uint64_t code_ = 0;
+		size_t code_length_ = 0;
+		uint64_t first_code_[MAX_CODE_LENGTH + 1];
+		size_t first_index_[MAX_CODE_LENGTH + 1];
+		size_t len_count_[MAX_CODE_LENGTH + 1];
+		symbol_array<Symbol, Alphabet> sorted_;
 	private:
+		bool is_leaf(node n) const
+		{
+			return (child_[0][n] | child_[1][n]) == 0;
+		}
 		void update(byte move);
-		void build(const byte* stream, const size_t& size);
-		void decode_bit(bool key, vector<byte>& output);
-		void create(const byte* input, const size_t& size);
+		bool read_field(const byte* stream, size_t size, size_t& it, int& value);
+		void build(const byte* stream, size_t size);
+		void build_canonical();
+		void build_table();
+		bool in_code() const;
+		void decode_bit(bool key, Symbol*& output);
+		bool decode_long(bit_reader& reader, Symbol*& output) const;
+		bool decode_rest(bit_reader& reader, Symbol* output, Symbol* end) const; // table lookups up to end
 	public:
-		void append(byte* input, size_t size); // size = 0 equals build
-		void decode(byte* input, size_t size, vector<byte>& output);
-
-		~HuffmanDecoder()
+		void append(const byte* input, size_t size); // size = 0 equals build
+		// false if the header was no code, the decoder is then left unbuilt and decodes nothing
+		bool valid() const
 		{
-			delete[] input_prev;
+			return valid_;
 		}
+		void decode(const byte* input, size_t size, vector<Symbol>& output);
+		// the same into output, returns the symbols produced; those past capacity are dropped,
+		// so capacity = the input length cuts off the padding of the last byte
+		size_t decode(const byte* input, size_t size, Symbol* output, size_t capacity);
+		// whole output of encode_interleaved, false if it is not output_size symbols
+		bool decode_interleaved(const byte* input, size_t size, Symbol* output, size_t output_size) const;
+		// whole output of encode, false if it is not output_size symbols;
+		// the decoder is left as it is, so one built decoder serves many streams
+		bool decode_stream(const byte* input, size_t size, Symbol* output, size_t output_size) const;
+		// one symbol, for callers that switch between decoders; false at the end of the stream
+		bool decode_symbol(bit_reader& reader, Symbol& symbol) const;
 	};
 
-	class HuffmanEncoder
+	// symbols below Alphabet
+	template <typename Symbol, size_t Alphabet>
+	class BasicHuffmanEncoder
 	{
 		//  
 		// n chunk-
@@ -100,24 +196,79 @@ namespace huffman
 		// chunk   chunk
 		//     (byte*)
 	public:
-		void encode(byte* input, size_t len, vector<byte>& output);
+		explicit BasicHuffmanEncoder(code_mode mode = TREE_CODES, size_t length_limit = MAX_CODE_LENGTH)
+			: mode(mode), length_limit(length_limit)
+		{
+		};
+		void encode(const Symbol* input, size_t len, vector<byte>& output);
+		// the same into output, returns the bytes written or NO_ROOM if they do not fit,
+		// which spoils the stream; never fails with capacity >= max_encoded_size(len)
+		size_t encode(const Symbol* input, size_t len, byte* output, size_t capacity);
+		size_t max_encoded_size(size_t len) const
+		{
+			return bit_writer::max_size(len, max_length);
+		}
+		// header and payload of len symbols coded in one stream, whatever they are:
+		// codes never take more bits than the fixed length code of the alphabet
+		static size_t max_compressed_size(size_t len)
+		{
+			return 4 + Alphabet * sizeof(Symbol) + 4 + Alphabet / 2 + len * sizeof(Symbol);
+		}
 		void write_tree(byte*& output, size_t& size); // convert tree to binafy form
-		void append(byte* data, size_t len); // add symbols
+		// the tree header into output, returns header_size() or NO_ROOM
+		size_t write_header(byte* output, size_t capacity);
+		size_t header_size();
+		void append(const Symbol* data, size_t len); // add symbols
+		void append_counts(const uint64_t* counts); // add Alphabet symbol counts
+		const code_word& get_code(Symbol symb) const
+		{
+			return codes[symb];
+		}
+		// the whole input at once, apart from encode
+		void encode_interleaved(const Symbol* input, size_t len, vector<byte>& output);
+		// extra payload bits the length limit costs against unlimited codes
+		uint64_t limit_loss() const
+		{
+			return limit_bits;
+		}
+		// payload bits of the appended symbols, known once the codes are built
+		uint64_t payload_bits() const
+		{
+			return coded_bits;
+		}
 
 	private:
-		tree_ptr tree;
-		map<byte, size_t> freqs;
-		map<byte, vector<byte>> codes;
-		vector<byte> bin_tree, nodes;
-		vector<byte> buf;
+		typedef typename node_index<Alphabet>::type node;
+		static const node NO_NODE = static_cast<node>(-1);
+		code_mode mode;
+		size_t length_limit;
+		uint64_t limit_bits = 0;
+		uint64_t coded_bits = 0;
+		symbol_array<flat_node<Symbol, node>, 2 * Alphabet> tree;
+		size_t tree_size = 0;
+		node root = 0;
+		// HISTOGRAMS interleaved histograms, so neighbouring symbols never wait on the same counter
+		symbol_array<uint64_t, HISTOGRAMS * Alphabet> freqs = {};
+		symbol_array<code_word, Alphabet> codes = {}; // length 0 for symbols not in the input
+		size_t max_length = 0;
+		uint32_t join_table[ALPHABET]; // codes of bytes for join_codes, if max_length allows
+		vector<byte> bin_tree;
+		vector<Symbol> nodes;
+		bit_writer writer;
 	private:
-		void simplify(byte* output, vector<byte>& bite_array, int& end);
-		void create_bin_code(tree_ptr cur);
-		void dfs(tree_ptr cur, vector<byte>& key);
+		void simplify(byte* output, vector<byte>& bite_array, size_t& end);
+		void put_symbols(const Symbol* input, size_t len);
+		void create_bin_code(node cur);
+		void make_canonical();
+		void limit_lengths(const uint64_t* freq);
 		void build();
-		void compression(vector<byte>& input, vector<byte>& output);
 		void clear();
 	};
+
+	typedef BasicHuffmanEncoder<byte, ALPHABET> HuffmanEncoder;
+	typedef BasicHuffmanDecoder<byte, ALPHABET> HuffmanDecoder;
+	typedef BasicHuffmanEncoder<wide_symbol, WIDE_ALPHABET> WideHuffmanEncoder;
+	typedef BasicHuffmanDecoder<wide_symbol, WIDE_ALPHABET> WideHuffmanDecoder;
 }
 
 
@@ -0,0 +1,90 @@
+#include "kernels.h"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define HUFFMAN_KERNELS_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define HUFFMAN_TARGET_AVX2
+#else
+#define HUFFMAN_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+namespace huffman
+{
+	void join_codes_portable(const byte* data, const size_t groups, const uint32_t* table, uint64_t* codes, byte* lengths)
+	{
+		for (size_t g = 0; g < groups; ++g, data += JOIN_SYMBOLS)
+		{
+			uint64_t code = 0;
+			size_t length = 0;
+			for (size_t k = 0; k < JOIN_SYMBOLS; ++k)
+			{
+				const uint32_t entry = table[data[k]];
+				code = (code << (entry & 0xff)) | (entry >> 8);
+				length += entry & 0xff;
+			}
+			codes[g] = code;
+			lengths[g] = static_cast<byte>(length);
+		}
+	}
+
+#ifdef HUFFMAN_KERNELS_AVX2
+	static bool has_avx2()
+	{
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6) // the OS saves the ymm registers
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}
+
+	// eight bytes a step: one gather for their entries, then neighbouring codes are joined
+	// in pairs within 64-bit lanes and the pairs of each 128-bit half into one group
+	HUFFMAN_TARGET_AVX2 static void join_codes_avx2(const byte* data, const size_t groups, const uint32_t* table,
+	                                                uint64_t* codes, byte* lengths)
+	{
+		const __m256i low = _mm256_set1_epi64x(0xffffffff);
+		const __m256i length_mask = _mm256_set1_epi32(0xff);
+		size_t g = 0;
+		for (; g + 2 <= groups; g += 2, data += 2 * JOIN_SYMBOLS)
+		{
+			int64_t word;
+			memcpy(&word, data, 8);
+			const __m256i index = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128(word));
+			const __m256i entry = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table), index, 4);
+			const __m256i length = _mm256_and_si256(entry, length_mask);
+			const __m256i bits = _mm256_srli_epi32(entry, 8);
+			const __m256i pair = _mm256_or_si256(
+				_mm256_sllv_epi64(_mm256_and_si256(bits, low), _mm256_srli_epi64(length, 32)),
+				_mm256_srli_epi64(bits, 32));
+			const __m256i pair_length = _mm256_add_epi64(_mm256_and_si256(length, low), _mm256_srli_epi64(length, 32));
+			const __m256i second_length = _mm256_srli_si256(pair_length, 8);
+			const __m256i group = _mm256_or_si256(_mm256_sllv_epi64(pair, second_length), _mm256_srli_si256(pair, 8));
+			const __m256i group_length = _mm256_add_epi64(pair_length, second_length);
+			codes[g] = _mm256_extract_epi64(group, 0);
+			codes[g + 1] = _mm256_extract_epi64(group, 2);
+			lengths[g] = static_cast<byte>(_mm256_extract_epi64(group_length, 0));
+			lengths[g + 1] = static_cast<byte>(_mm256_extract_epi64(group_length, 2));
+		}
+		join_codes_portable(data, groups - g, table, codes + g, lengths + g);
+	}
+#endif
+
+	void join_codes(const byte* data, const size_t groups, const uint32_t* table, uint64_t* codes, byte* lengths)
+	{
+#ifdef HUFFMAN_KERNELS_AVX2
+		static const bool avx2 = has_avx2();
+		if (avx2)
+			return join_codes_avx2(data, groups, table, codes, lengths);
+#endif
+		join_codes_portable(data, groups, table, codes, lengths);
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+
+#include <cstddef>
+#include <cstdint>
+
+namespace huffman
+{
+	typedef unsigned char byte;
+
+	// join_codes takes the codes of bytes as bits << 8 | length, lengths up to JOIN_CODE_BITS,
+	// so JOIN_SYMBOLS of them fit in 64 bits
+	const size_t JOIN_CODE_BITS = 16;
+	const size_t JOIN_SYMBOLS = 4;
+
+	// codes[g] gets the codes of data[JOIN_SYMBOLS * g...] joined, the first in the highest bits,
+	// and lengths[g] their total length, for g < groups.
+	// Uses AVX2 gathers when the CPU has them, checked once
+	void join_codes(const byte* data, size_t groups, const uint32_t* table, uint64_t* codes, byte* lengths);
+	// the same values without AVX2
+	void join_codes_portable(const byte* data, size_t groups, const uint32_t* table, uint64_t* codes, byte* lengths);
+}
+
+
+#endif
@@ -0,0 +1,90 @@
+#include "mapped_file.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define HUFFMAN_MMAP
+#endif
+
+namespace huffman
+{
+#ifdef HUFFMAN_MMAP
+	bool mapped_file::open_read(const std::string& filename)
+	{
+		close();
+		fd_ = ::open(filename.c_str(), O_RDONLY);
+		if (fd_ < 0)
+			return false;
+		struct stat info;
+		if (fstat(fd_, &info) != 0 || !S_ISREG(info.st_mode))
+		{
+			close();
+			return false;
+		}
+		size_ = info.st_size;
+		if (size_ == 0)
+			return true;
+		void* map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+		if (map == MAP_FAILED)
+		{
+			close();
+			return false;
+		}
+		data_ = static_cast<byte*>(map);
+		madvise(map, size_, MADV_SEQUENTIAL);
+		return true;
+	}
+
+	bool mapped_file::create(const std::string& filename, const uint64_t size)
+	{
+		close();
+		fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd_ < 0)
+			return false;
+		struct stat info;
+		if (fstat(fd_, &info) != 0 || !S_ISREG(info.st_mode) || ftruncate(fd_, size) != 0)
+		{
+			close();
+			return false;
+		}
+		size_ = size;
+		if (size_ == 0)
+			return true;
+		void* map = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+		if (map == MAP_FAILED)
+		{
+			close();
+			return false;
+		}
+		data_ = static_cast<byte*>(map);
+		return true;
+	}
+
+	void mapped_file::close()
+	{
+		if (data_)
+			munmap(data_, size_);
+		if (fd_ >= 0)
+			::close(fd_);
+		data_ = nullptr;
+		size_ = 0;
+		fd_ = -1;
+	}
+#else
+	bool mapped_file::open_read(const std::string&)
+	{
+		return false;
+	}
+
+	bool mapped_file::create(const std::string&, const uint64_t)
+	{
+		return false;
+	}
+
+	void mapped_file::close()
+	{
+	}
+#endif
+}
@@ -0,0 +1,48 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace huffman
+{
+	typedef unsigned char byte;
+
+	// whole regular file mapped into memory, POSIX only:
+	// elsewhere open_read and create fail and callers go through streams
+	class mapped_file
+	{
+	public:
+		mapped_file() = default;
+		mapped_file(mapped_file const&) = delete;
+		mapped_file& operator=(mapped_file const&) = delete;
+		~mapped_file()
+		{
+			close();
+		}
+
+		bool open_read(const std::string& filename); // false if not a regular file
+		bool create(const std::string& filename, uint64_t size); // writable, of exactly size bytes
+		void close();
+
+		byte* data() const
+		{
+			return data_;
+		}
+
+		size_t size() const
+		{
+			return size_;
+		}
+
+	private:
+		byte* data_ = nullptr;
+		size_t size_ = 0;
+		int fd_ = -1;
+	};
+}
+
+
+#endif
@@ -0,0 +1,94 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace huffman
+{
+	// bounded FIFO between the stages of a pipeline: push waits while it is full, pop while it is empty;
+	// after close, pop drains what is left and then fails
+	template <typename T>
+	class ring_buffer
+	{
+	public:
+		explicit ring_buffer(size_t capacity) : slots_(capacity)
+		{
+		}
+		ring_buffer(ring_buffer const&) = delete;
+		ring_buffer& operator=(ring_buffer const&) = delete;
+
+		void push(T value)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			not_full_.wait(lock, [this]() { return size_ < slots_.size(); });
+			put(value);
+		}
+
+		bool try_push(T& value) // false and value kept if full
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (size_ == slots_.size())
+				return false;
+			put(value);
+			return true;
+		}
+
+		bool pop(T& value)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			not_empty_.wait(lock, [this]() { return size_ != 0 || closed_; });
+			if (size_ == 0)
+				return false;
+			take(value);
+			return true;
+		}
+
+		bool try_pop(T& value)
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			if (size_ == 0)
+				return false;
+			take(value);
+			return true;
+		}
+
+		void close()
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			closed_ = true;
+			not_empty_.notify_all();
+		}
+
+	private:
+		void put(T& value)
+		{
+			slots_[(head_ + size_) % slots_.size()] = std::move(value);
+			++size_;
+			not_empty_.notify_one();
+		}
+
+		void take(T& value)
+		{
+			value = std::move(slots_[head_]);
+			head_ = (head_ + 1) % slots_.size();
+			--size_;
+			not_full_.notify_one();
+		}
+
+		std::vector<T> slots_;
+		size_t head_ = 0;
+		size_t size_ = 0;
+		bool closed_ = false;
+		std::mutex mutex_;
+		std::condition_variable not_full_;
+		std::condition_variable not_empty_;
+	};
+}
+
+
+#endif
@@ -0,0 +1,56 @@
+#include "thread_pool.h"
+#include <algorithm>
+
+namespace huffman
+{
+	thread_pool::thread_pool(size_t threads)
+	{
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		try
+		{
+			workers_.reserve(threads);
+			for (size_t i = 0; i < threads; ++i)
+				workers_.push_back(std::thread(&thread_pool::work, this));
+		}
+		catch (...) // joinable threads must not be destroyed
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				stop_ = true;
+			}
+			ready_.notify_all();
+			for (auto& worker : workers_)
+				worker.join();
+			throw;
+		}
+	}
+
+	thread_pool::~thread_pool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+		}
+		ready_.notify_all();
+		for (auto& worker : workers_)
+			worker.join();
+	}
+
+	void thread_pool::work()
+	{
+		for (;;)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				ready_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+				if (tasks_.empty()) // stopped and drained
+					return;
+				task = std::move(tasks_.front());
+				tasks_.pop_front();
+			}
+			task();
+		}
+	}
+}
@@ -0,0 +1,57 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace huffman
+{
+	// fixed set of workers taking tasks in submission order
+	class thread_pool
+	{
+	public:
+		explicit thread_pool(size_t threads); // 0 means one per core
+		~thread_pool();
+		thread_pool(thread_pool const&) = delete;
+		thread_pool& operator=(thread_pool const&) = delete;
+
+		size_t size() const
+		{
+			return workers_.size();
+		}
+
+		template <typename F>
+		std::future<typename std::result_of<F()>::type> submit(F task)
+		{
+			typedef typename std::result_of<F()>::type result;
+			const auto packaged = std::make_shared<std::packaged_task<result()>>(task);
+			std::future<result> future = packaged->get_future();
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				tasks_.push_back([packaged]() { (*packaged)(); });
+			}
+			ready_.notify_one();
+			return future;
+		}
+
+	private:
+		void work();
+
+		std::vector<std::thread> workers_;
+		std::deque<std::function<void()>> tasks_;
+		std::mutex mutex_;
+		std::condition_variable ready_;
+		bool stop_ = false;
+	};
+}
+
+
+#endif
@@ -1,177 +1,254 @@
-#include "library/huffman.h"
+#include "library/huffarchive.h"
+#include "library/huffdict.h"
 #include "library/huffexception.h"
-#include <iostream>
+#include <algorithm>
+#include <cctype>
+#include <climits>
 #include <fstream>
-#include "gtest/gtest.h"
+#include <iostream>
+#include <stdexcept>
+#include <thread>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
-#include "library/huffman.h"
-#include <algorithm>
 using namespace huffman;
 
-void compress(string filename_in, string filename_out, string filename_hf)
+const size_t MAX_THREADS_PER_CORE = 4;
+
+void usage()
 {
-	std::ifstream fin(filename_in.c_str(), std::ios_base::binary);
-	if (!fin.is_open())
-	{
-		throw HuffException(HuffException::INFILE_NOT_OPEN, filename_in);
-	}
+	std::cout << "Usage: huffman [-d] [-j threads] [-b block_size] [-m memory] [-l bits] [-i] [-c] [--no-mmap] [--no-verify] [--range offset:length] input_file [output_file]"
+		<< std::endl
+		<< "       huffman --train dictionary sample_file..." << std::endl
+		<< "       huffman [-d] [-j threads] -D dictionary input_file..." << std::endl
+		<< "  - as a file name is standard input or output, data is then coded in one pass" << std::endl
+		<< "  -j N  code N blocks at once, 0 uses every core, at most 4 per core" << std::endl
+		<< "  -b N  block size in bytes, K and M suffixes allowed (default 1M, at most 1G)" << std::endl
+		<< "  -m N  bytes of blocks in flight while decoding (default 64M)" << std::endl
+		<< "  -l N  longest code in bits, e.g. 11, 12 or 15, at most 64; the ratio loss is reported (default 64)" << std::endl
+		<< "  -i    code every block as 4 interleaved streams, faster to decode" << std::endl
+		<< "  -c    pick the code table by the previous byte, smaller for text" << std::endl
+		<< "  --no-mmap  read and write through streams instead of mapping regular files" << std::endl
+		<< "  --no-verify  skip the block checksums of trusted archives" << std::endl
+		<< "  --range N:L  decode only L bytes from N (to the end without L), the input must be an archive file" << std::endl
+		<< "  --train D  write dictionary D with one table fitted to all the samples, -l applies" << std::endl
+		<< "  -D D  code every input with dictionary D to input.huc, or back with -d; no table per file" << std::endl;
+}
 
-	std::ofstream fhf(filename_hf.c_str(), std::ios_base::binary);
-	if (!fhf.is_open())
-	{
-		fin.close();
-		throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename_hf);
-	}
-	char* input_chunk = new char[BUFFER];
-	byte* chunk;
-	HuffmanEncoder encoder;
-	size_t main_size = 0;
-	for (;;)
+uint64_t parse_size(const string& arg)
+{
+	// stoull would take "-1" as UINT64_MAX
+	if (arg.empty() || !isdigit(static_cast<unsigned char>(arg[0])))
+		throw std::invalid_argument(arg);
+	size_t end = 0;
+	const uint64_t value = std::stoull(arg, &end);
+	const string suffix = arg.substr(end);
+	size_t shift = 0;
+	if (suffix == "K" || suffix == "k")
+		shift = 10;
+	else if (suffix == "M" || suffix == "m")
+		shift = 20;
+	else if (!suffix.empty())
+		throw std::invalid_argument(arg);
+	if (value > UINT64_MAX >> shift)
+		throw std::invalid_argument(arg);
+	return value << shift;
+}
+
+// counts above limit are refused, like -j -1 which stoul wraps to SIZE_MAX
+size_t parse_count(const string& arg, const size_t limit)
+{
+	if (arg.empty() || !isdigit(static_cast<unsigned char>(arg[0])))
+		throw std::invalid_argument(arg);
+	size_t end = 0;
+	const unsigned long long value = std::stoull(arg, &end);
+	if (end != arg.size() || value > limit)
+		throw std::invalid_argument(arg);
+	return static_cast<size_t>(value);
+}
+
+string describe(const HuffException& e)
+{
+	switch (e.get_error())
 	{
-		fin.read(input_chunk, BUFFER);
-		chunk = reinterpret_cast<byte*>(input_chunk);
-		const auto size = fin ? BUFFER : fin.gcount();
-		main_size += size;
-		encoder.append(chunk, size);
-		if (!fin)
-		{
-			encoder.append(chunk, 0);
-			break;
-		}
+	case HuffException::INFILE_NOT_OPEN:
+		return "can't open input file " + e.get_filename();
+	case HuffException::OUTFILE_NOT_OPEN:
+		return "can't write output file " + (e.get_filename().empty() ? "<stdout>" : e.get_filename());
+	default:
+		return "corrupted or unsupported file " + (e.get_filename().empty() ? "<stdin>" : e.get_filename());
 	}
-	vector<byte> output;
-	byte* out = nullptr;
-	size_t out_size;
-	encoder.write_tree(out, out_size);
-	fhf.write(reinterpret_cast<const char*>(&out[0]), out_size);
-	delete[] out;
-	fhf.close();
+}
 
+void report_limit(const archive_options& options, const archive_stats& stats)
+{
+	if (options.max_code_length >= MAX_CODE_LENGTH || stats.raw_size == 0)
+		return;
+	const uint64_t loss = (stats.limit_loss + CHAR_BIT - 1) / CHAR_BIT;
+	std::cerr << "huffman: codes limited to " << options.max_code_length << " bits cost " << loss << " bytes, ratio "
+		<< 100.0 * stats.packed_size / stats.raw_size << "% instead of "
+		<< 100.0 * (stats.packed_size - std::min(loss, stats.packed_size)) / stats.raw_size << "%" << std::endl;
+}
 
-	std::ofstream fout(filename_out.c_str(), std::ios_base::binary);
-	if (!fout.is_open())
+// input or output of "-" goes through the standard streams
+void run(const bool decode, const string& input, const string& output, const archive_options& options)
+{
+	if (input != "-" && output != "-")
 	{
-		fin.close();
-		throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename_out);
+		if (decode)
+			decompress_file(input, output, options);
+		else
+			report_limit(options, compress_file(input, output, options));
+		return;
 	}
-	fin.clear();
-	fin.seekg(0);
-	fout.write(reinterpret_cast<char*>(&main_size), sizeof (size_t));
-	for (;;)
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	std::ifstream fin;
+	std::ofstream fout;
+	if (input != "-")
 	{
-		fin.read(input_chunk, BUFFER);
-		const auto size = fin ? BUFFER : fin.gcount();
-		chunk = reinterpret_cast<byte*>(input_chunk);
-		encoder.encode(chunk, size, output);
-		if (!output.empty())
-		{
-			fout.write(reinterpret_cast<const char*>(&output[0]), output.size());
-		}
-		if (!fin)
-		{
-			encoder.encode(chunk, 0, output);
-			if (!output.empty())
-				fout.write(reinterpret_cast<const char*>(&output[0]), output.size());
-			break;
-		}
+		fin.open(input.c_str(), std::ios_base::binary);
+		if (!fin.is_open())
+			throw HuffException(HuffException::INFILE_NOT_OPEN, input);
 	}
-
-	fin.close();
-	fout.close();
-	delete[] input_chunk;
+	if (output != "-")
+	{
+		fout.open(output.c_str(), std::ios_base::binary);
+		if (!fout.is_open())
+			throw HuffException(HuffException::OUTFILE_NOT_OPEN, output);
+	}
+	std::istream& in = input == "-" ? std::cin : fin;
+	std::ostream& out = output == "-" ? std::cout : fout;
+	if (decode)
+		decompress_stream(in, out, options);
+	else
+		report_limit(options, compress_stream(in, out, options));
+	out.flush();
 }
 
-void decompress(string filename_in, string filename_out, string filename_hf)
+void run_range(const string& input, const string& output, const uint64_t offset, const uint64_t length,
+               const archive_options& options)
 {
-	std::ifstream fhf(filename_hf.c_str(), std::ios_base::binary);
-	if (!fhf.is_open())
-		throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename_hf);
-	char* input_chunk = new char[BUFFER];
-	byte* chunk;
-	HuffmanDecoder dencoder;
-	for (;;) // read & build tree
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+	std::ofstream fout;
+	if (output != "-")
 	{
-		fhf.read(input_chunk, BUFFER);
-		chunk = reinterpret_cast<byte*>(input_chunk);
-		const auto size = fhf ? BUFFER : fhf.gcount();
-		dencoder.append(chunk, size);
-		if (!fhf)
-		{
-			dencoder.append(chunk, 0); // build tree
-			break;
-		}
+		fout.open(output.c_str(), std::ios_base::binary);
+		if (!fout.is_open())
+			throw HuffException(HuffException::OUTFILE_NOT_OPEN, output);
 	}
-	fhf.close();
-	std::ifstream fin(filename_in.c_str(), std::ios_base::binary);
-	if (!fin.is_open())
-		throw HuffException(HuffException::INFILE_NOT_OPEN, filename_in);
-	vector<byte> output;
+	std::ostream& out = output == "-" ? std::cout : fout;
+	decompress_range(input, out, offset, length, options);
+	out.flush();
+}
 
-	std::ofstream fout(filename_out.c_str(), std::ios_base::binary);
-	if (!fout.is_open())
+// every file is an input, so the process starts once for all of them
+void run_batch(const bool decode, const string& train, const string& dictionary, const vector<string>& files,
+               const archive_options& options)
+{
+	if (!train.empty())
 	{
-		fin.close();
-		throw HuffException(HuffException::OUTFILE_NOT_OPEN, filename_out);
+		save_dictionary(train_dictionary(files, options.max_code_length), train);
+		return;
 	}
-	size_t main_size = 0;
-	fin.read(reinterpret_cast<char*>(&main_size), sizeof (size_t));
-	for (;;)
-	{
-		fin.read(input_chunk, BUFFER);
-		const auto size = fin ? BUFFER : fin.gcount();
-		chunk = reinterpret_cast<byte*>(input_chunk);
-		dencoder.decode(chunk, size, output);
-		const size_t out_size = std::min(main_size, output.size());
-		if (!output.empty())
-		{
-			fout.write(reinterpret_cast<const char*>(&output[0]), out_size);
-			main_size -= out_size;
-		}
-		if (!fin || !out_size)
-			break;
-	}
-	delete[] input_chunk;
-	fin.close();
-	fout.close();
+	const HuffDictionary table = load_dictionary(dictionary);
+	if (decode)
+		decompress_files(table, files, options.threads);
+	else
+		compress_files(table, files, options.threads);
 }
 
 int main(int argc, char* argv[])
 {
-	if (argc == 1)
+	bool decode = false;
+	bool range = false;
+	uint64_t range_offset = 0, range_length = UINT64_MAX;
+	string train, dictionary;
+	archive_options options;
+	vector<string> files;
+	try
 	{
-		std::cout << "Usage: huffman [-d] input_file [output_file]" << std::endl;
-		return 0;
+		for (int i = 1; i < argc; ++i)
+		{
+			const string arg = argv[i];
+			if (arg == "-d")
+				decode = true;
+			else if (arg == "--no-mmap")
+				options.mapped = false;
+			else if (arg == "--no-verify")
+				options.verify = false;
+			else if (arg == "-i")
+				options.interleaved = true;
+			else if (arg == "-c")
+				options.context = true;
+			else if (arg == "-j" && i + 1 < argc)
+				options.threads = parse_count(argv[++i], MAX_THREADS_PER_CORE * std::max(1u, std::thread::hardware_concurrency()));
+			else if (arg == "-b" && i + 1 < argc)
+				options.block_size = parse_size(argv[++i]);
+			else if (arg == "-m" && i + 1 < argc)
+				options.memory = parse_size(argv[++i]);
+			else if (arg == "-l" && i + 1 < argc)
+				options.max_code_length = parse_count(argv[++i], MAX_CODE_LENGTH);
+			else if (arg == "--train" && i + 1 < argc)
+				train = argv[++i];
+			else if (arg == "-D" && i + 1 < argc)
+				dictionary = argv[++i];
+			else if (arg == "--range" && i + 1 < argc)
+			{
+				const string value = argv[++i];
+				const size_t colon = value.find(':');
+				range = true;
+				range_offset = parse_size(value.substr(0, colon));
+				if (colon != string::npos && colon + 1 < value.size())
+					range_length = parse_size(value.substr(colon + 1));
+			}
+			else if (arg[0] != '-' || arg == "-")
+				files.push_back(arg);
+			else
+				throw std::invalid_argument(arg);
+		}
 	}
-
-	bool decode = false;
-	if (string(argv[1]) == "-d")
-		decode = true;
-
-	if (argc == 2 && decode)
+	catch (const std::exception&)
 	{
-		std::cout << "Usage: huffman [-d] input_file [output_file]" << std::endl;
-		return 0;
+		usage();
+		return 1;
 	}
-
-	const string input = argv[1 + decode];
-
-	string output;
-	if (argc == 3 + decode) // find name output
+	const bool batch = !train.empty() || !dictionary.empty();
+	if (files.empty() || (files.size() > 2 && !batch) || options.block_size == 0 || options.block_size > MAX_BLOCK_SIZE
+		|| (range && files[0] == "-")
+		|| (batch && (range || std::find(files.begin(), files.end(), "-") != files.end())))
 	{
-		output = argv[2 + decode];
+		usage();
+		return 0;
 	}
-	else
+
+	const string input = files[0];
+	const string output = files.size() == 2 ? files[1] : "output.out";
+	std::ios_base::sync_with_stdio(false);
+	try
 	{
-		output = "output.out";
+		if (batch)
+			run_batch(decode, train, dictionary, files, options);
+		else if (range)
+			run_range(input, output, range_offset, range_length, options);
+		else
+			run(decode, input, output, options);
 	}
-	const string out_hf = "output.hf";
-	if(decode)
+	catch (const HuffException& e)
 	{
-		decompress(input, output, out_hf);
+		std::cerr << "huffman: " << describe(e) << std::endl;
+		return 1;
 	}
-	else
+	catch (const std::exception& e) // out of memory or threads
 	{
-		compress(input, output, out_hf);
+		std::cerr << "huffman: " << e.what() << std::endl;
+		return 1;
 	}
 	return 0;
 }
@@ -1,8 +1,15 @@
 #include <library/huffman.h>
+#include <library/huffarchive.h>
+#include <library/huffcontext.h>
+#include <library/huffdict.h>
+#include <library/crc32c.h>
+#include <library/huffexception.h>
 
 #include <gtest/gtest.h>
 
 #include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <sstream>
 #include <vector>
 
@@ -63,7 +70,10 @@ void compress(string filename_in, string filename_out, string filename_hf)
 	std::ofstream fout(filename_out.c_str(), std::ios_base::binary);
 	fin.clear();
 	fin.seekg(0);
-	fout.write(reinterpret_cast<char*>(&main_size), sizeof (size_t));
+	byte size_field[8];
+	size_t end = 0;
+	write_le64(size_field, main_size, end);
+	fout.write(reinterpret_cast<char*>(size_field), sizeof size_field);
 	for (;;)
 	{
 		fin.read(input_chunk, BUFFER);
@@ -133,10 +143,43 @@ void decompress(string filename_in, string filename_out, string filename_hf)
 	fout.close();
 }
 
-void run_encode()
+void generate(const size_t buf)
+{
+	std::ofstream fout(filename_input.c_str(), std::ios_base::binary);
+	for (size_t i = 0; i < buf; ++i)
+	{
+		byte* out = new byte[buf];
+		for (size_t j = 0; j < buf; ++j)
+		{
+			out[j] = rand() % 255;
+		}
+		fout.write(reinterpret_cast<const char*>(out), buf);
+		delete[] out;
+	}
+	fout.close();
+}
+
+// symbols first, first + 1... repeated 1, 1, 2, 3, 5... times and shuffled:
+// the most skewed counts, so their codes grow one bit per symbol
+vector<byte> fibonacci(const size_t symbols, const byte first = 0)
+{
+	vector<byte> fib;
+	size_t prev = 1, cur = 1;
+	for (size_t s = 0; s < symbols; ++s)
+	{
+		fib.insert(fib.end(), prev, static_cast<byte>(first + s));
+		const size_t next = prev + cur;
+		prev = cur;
+		cur = next;
+	}
+	std::random_shuffle(fib.begin(), fib.end());
+	return fib;
+}
+
+void run_encode(code_mode mode, size_t length_limit)
 {
 	byte* chunk = new byte[BUFFER];
-	HuffmanEncoder encoder;
+	HuffmanEncoder encoder(mode, length_limit);
 	main_size = 0;
 	size_t stream_it = 0;
 	for (;;)
@@ -230,7 +273,7 @@ void run_decode()
 }
 
 
-string run_encode_decode(string& s)
+string run_encode_decode(string& s, code_mode mode = TREE_CODES, size_t length_limit = MAX_CODE_LENGTH)
 {
 	huf_size = 0;
 	input_size = 0;
@@ -241,10 +284,10 @@ string run_encode_decode(string& s)
 	main_size = 0;
 	assert(s.length() < TEST_BUF);
 	char* c_inp = new char[TEST_BUF];
-	strcpy(c_inp, s.c_str());
+	memcpy(c_inp, s.data(), s.length());
 	input = reinterpret_cast<byte*>(c_inp);
 	input_size = s.length();
-	run_encode();
+	run_encode(mode, length_limit);
 	run_decode();
 	char* c_out = reinterpret_cast<char*>(output);
 	string out = "";
@@ -316,23 +359,359 @@ TEST(encode_decode, random)
 	}
 }
 
+TEST(encode_decode, long_codes)
+{
+	// fibonacci frequencies give codes longer than the decode table index
+	const vector<byte> fib = fibonacci(14, 'a');
+	string test(fib.begin(), fib.end());
+	string decode = run_encode_decode(test);
+	ASSERT_EQ(test, decode);
+	decode = run_encode_decode(test, CANONICAL_CODES);
+	ASSERT_EQ(test, decode);
+	for (size_t limit = 1; limit <= 6; ++limit) // 14 symbols need 4 bits at least
+	{
+		decode = run_encode_decode(test, TREE_CODES, limit);
+		ASSERT_EQ(test, decode);
+		decode = run_encode_decode(test, CANONICAL_CODES, limit);
+		ASSERT_EQ(test, decode);
+		ASSERT_EQ(4 + ALPHABET, huf_size);
+	}
+}
+
+TEST(encode_decode, split_header)
+{
+	// the tree header fed in chunks that split its int fields
+	const string test = "abracadabra, abracadabra and some more text";
+	for (const auto mode : {TREE_CODES, CANONICAL_CODES})
+	{
+		HuffmanEncoder encoder(mode);
+		const byte* data = reinterpret_cast<const byte*>(test.data());
+		encoder.append(data, test.size());
+		encoder.append(data, 0);
+		byte* table;
+		size_t table_size;
+		encoder.write_tree(table, table_size);
+		vector<byte> payload, tail;
+		encoder.encode(data, test.size(), payload);
+		encoder.encode(data, 0, tail);
+		payload.insert(payload.end(), tail.begin(), tail.end());
+		for (size_t chunk = 1; chunk <= 5; ++chunk)
+		{
+			HuffmanDecoder decoder;
+			for (size_t i = 0; i < table_size; i += chunk)
+				decoder.append(table + i, std::min(chunk, table_size - i));
+			decoder.append(table, 0);
+			vector<byte> decoded;
+			decoder.decode(payload.data(), payload.size(), decoded);
+			ASSERT_EQ(test, string(decoded.begin(), decoded.begin() + test.size()));
+		}
+		delete[] table;
+	}
+}
 
-void generate(const size_t buf)
+TEST(encode_decode, caller_buffers)
 {
-	std::ofstream fout(filename_input.c_str(), std::ios_base::binary);
-	for (int i = 0; i < buf; ++i)
+	// one buffer of max_compressed_size holds header and payload of any input
+	for (const auto mode : {TREE_CODES, CANONICAL_CODES})
+		for (const size_t kind : {0, 1, 2})
+		{
+			string test;
+			for (size_t i = 0; i < 3000; ++i)
+				test.push_back(static_cast<char>(kind == 0 ? 'x' : kind == 1 ? rand() % 256 : (rand() % 50 ? 'a' : i % 256)));
+			const byte* data = reinterpret_cast<const byte*>(test.data());
+			HuffmanEncoder encoder(mode, 12);
+			encoder.append(data, test.size());
+			encoder.append(data, 0);
+			vector<byte> packed(HuffmanEncoder::max_compressed_size(test.size()));
+			ASSERT_EQ(NO_ROOM, encoder.write_header(packed.data(), encoder.header_size() - 1));
+			const size_t header = encoder.write_header(packed.data(), packed.size());
+			ASSERT_EQ(encoder.header_size(), header);
+			size_t end = header;
+			end += encoder.encode(data, test.size(), packed.data() + end, packed.size() - end);
+			end += encoder.encode(data, 0, packed.data() + end, packed.size() - end);
+			ASSERT_LE(end, packed.size());
+
+			HuffmanDecoder decoder;
+			decoder.append(packed.data(), header);
+			decoder.append(packed.data(), 0);
+			vector<byte> decoded(test.size());
+			ASSERT_EQ(test.size(), decoder.decode(packed.data() + header, end - header, decoded.data(), decoded.size()));
+			ASSERT_EQ(test, string(decoded.begin(), decoded.end()));
+
+			HuffmanEncoder small(mode, 12);
+			small.append(data, test.size());
+			small.append(data, 0);
+			ASSERT_EQ(NO_ROOM, small.encode(data, test.size(), packed.data(), (end - header) / 2));
+		}
+}
+
+TEST(encode_decode, bit_reader)
+{
+	// fields of 1..40 bits read back across the fast refills and the bytewise end
+	for (const size_t count : {0, 1, 7, 100, 5000})
 	{
-		byte* out = new byte[buf];
-		for (int j = 0; j < buf; ++j)
+		vector<pair<uint64_t, size_t>> fields;
+		for (size_t i = 0; i < count; ++i)
 		{
-			out[j] = rand() % 255;
+			const size_t length = 1 + rand() % 40;
+			fields.push_back({(static_cast<uint64_t>(rand()) << 31 ^ rand()) & ((1ull << length) - 1), length});
 		}
-		fout.write(reinterpret_cast<const char*>(out), buf);
-		delete[] out;
+		vector<byte> stream(count * 5 + 8);
+		bit_writer writer;
+		writer.reset(stream.data());
+		for (const auto& field : fields)
+			writer.put(field.first, field.second);
+		writer.flush();
+		stream.resize(writer.position() - stream.data());
+
+		bit_reader reader;
+		reader.reset(stream.data(), stream.size());
+		for (const auto& field : fields)
+		{
+			reader.refill();
+			ASSERT_GE(reader.count(), field.second);
+			ASSERT_EQ(field.first, reader.peek() >> (64 - field.second));
+			reader.consume(field.second);
+		}
+		reader.refill();
+		ASSERT_LT(reader.count(), 8u); // the padding of the last byte
+		ASSERT_EQ(0u, reader.peek());
 	}
-	fout.close();
 }
 
+TEST(encode_decode, join_codes)
+{
+	// the dispatched kernel and the portable one agree on codes of every length
+	uint32_t table[ALPHABET];
+	for (size_t s = 0; s < ALPHABET; ++s)
+	{
+		const size_t length = 1 + rand() % JOIN_CODE_BITS;
+		table[s] = static_cast<uint32_t>((rand() & ((1 << length) - 1)) << 8 | length);
+	}
+	vector<byte> data(JOIN_SYMBOLS * 101);
+	for (auto& x : data)
+		x = static_cast<byte>(rand() % 256);
+	vector<uint64_t> codes(101), expected_codes(101);
+	vector<byte> lengths(101), expected_lengths(101);
+	join_codes(data.data(), 101, table, codes.data(), lengths.data());
+	join_codes_portable(data.data(), 101, table, expected_codes.data(), expected_lengths.data());
+	ASSERT_EQ(expected_codes, codes);
+	ASSERT_EQ(expected_lengths, lengths);
+	ASSERT_EQ(table[data[0]] >> 8, codes[0] >> (lengths[0] - (table[data[0]] & 0xff)));
+}
+
+TEST(encode_decode, interleaved)
+{
+	// short inputs leave some of the streams empty, fibonacci ones need the long code path
+	vector<vector<byte>> tests;
+	for (size_t size = 0; size < 40; ++size)
+		tests.push_back(vector<byte>(size, 'a'));
+	const vector<byte> fib = fibonacci(20);
+	tests.push_back(fib);
+	for (size_t size = 1; size < 40; ++size)
+		tests.push_back(vector<byte>(fib.begin(), fib.begin() + size));
+	for (const auto mode : {TREE_CODES, CANONICAL_CODES})
+	{
+		for (const auto& test : tests)
+		{
+			HuffmanEncoder encoder(mode);
+			encoder.append(test.data(), test.size());
+			encoder.append(test.data(), 0);
+			byte* table;
+			size_t table_size;
+			encoder.write_tree(table, table_size);
+			vector<byte> payload;
+			encoder.encode_interleaved(test.data(), test.size(), payload);
+			HuffmanDecoder decoder;
+			decoder.append(table, table_size);
+			decoder.append(table, 0);
+			vector<byte> decoded(test.size());
+			ASSERT_TRUE(decoder.decode_interleaved(payload.data(), payload.size(), decoded.data(), decoded.size()));
+			ASSERT_EQ(test, decoded);
+			if (!test.empty())
+			{
+				ASSERT_FALSE(decoder.decode_interleaved(payload.data(), payload.size() - 1, decoded.data(), decoded.size()));
+			}
+			delete[] table;
+		}
+	}
+}
+
+TEST(encode_decode, wide_symbols)
+{
+	// tokens over the whole 16-bit range, skewed so that some codes are longer than a table index
+	vector<wide_symbol> test;
+	for (size_t i = 0; i < 30000; ++i)
+	{
+		const size_t rank = rand() % (rand() % 2000 + 1);
+		test.push_back(static_cast<wide_symbol>(rank * 40503));
+	}
+	vector<byte> split(reinterpret_cast<const byte*>(test.data()), reinterpret_cast<const byte*>(test.data() + test.size()));
+	HuffmanEncoder byte_encoder(CANONICAL_CODES);
+	byte_encoder.append(split.data(), split.size());
+	byte_encoder.append(split.data(), 0);
+	vector<byte> split_payload, tail;
+	byte_encoder.encode(split.data(), split.size(), split_payload);
+	byte_encoder.encode(split.data(), 0, tail);
+	split_payload.insert(split_payload.end(), tail.begin(), tail.end());
+
+	for (const auto mode : {TREE_CODES, CANONICAL_CODES})
+	{
+		WideHuffmanEncoder encoder(mode);
+		encoder.append(test.data(), test.size());
+		encoder.append(test.data(), 0);
+		byte* table;
+		size_t table_size;
+		encoder.write_tree(table, table_size);
+		vector<byte> payload, interleaved;
+		encoder.encode(test.data(), test.size(), payload);
+		encoder.encode(test.data(), 0, tail);
+		payload.insert(payload.end(), tail.begin(), tail.end());
+		encoder.encode_interleaved(test.data(), test.size(), interleaved);
+		ASSERT_LT(payload.size(), split_payload.size() * 3 / 4);
+
+		WideHuffmanDecoder decoder;
+		for (size_t i = 0; i < table_size; i += 3) // splits symbols of the tree header
+			decoder.append(table + i, std::min<size_t>(3, table_size - i));
+		decoder.append(table, 0);
+		vector<wide_symbol> decoded;
+		decoder.decode(payload.data(), payload.size(), decoded);
+		ASSERT_EQ(test, vector<wide_symbol>(decoded.begin(), decoded.begin() + test.size()));
+		decoded.assign(test.size(), 0);
+		ASSERT_TRUE(decoder.decode_interleaved(interleaved.data(), interleaved.size(), decoded.data(), decoded.size()));
+		ASSERT_EQ(test, decoded);
+		delete[] table;
+	}
+}
+
+TEST(encode_decode, context)
+{
+	// text where the next letter depends on the one before
+	const string words[] = {"the ", "quick ", "brown ", "fox ", "jumps ", "over ", "lazy ", "dog "};
+	string text;
+	while (text.size() < 100000)
+		text += words[rand() % 8];
+	string noise;
+	for (size_t i = 0; i < 5000; ++i)
+		noise.push_back(static_cast<char>(rand()));
+	const string tests[] = {"", "a", "ab", "abracadabra", text, noise};
+	for (const auto& test : tests)
+	{
+		const byte* data = reinterpret_cast<const byte*>(test.data());
+		ContextEncoder encoder;
+		encoder.append(data, test.size() / 2); // in two parts
+		encoder.append(data + test.size() / 2, test.size() - test.size() / 2);
+		encoder.append(data, 0);
+		vector<byte> tables, payload;
+		encoder.write_tables(tables);
+		encoder.encode(data, test.size(), payload);
+
+		ContextDecoder decoder;
+		ASSERT_TRUE(decoder.read_tables(tables.data(), tables.size()));
+		vector<byte> decoded(test.size());
+		ASSERT_TRUE(decoder.decode(payload.data(), payload.size(), decoded.data(), decoded.size()));
+		ASSERT_EQ(test, string(decoded.begin(), decoded.end()));
+		if (!test.empty())
+		{
+			ASSERT_FALSE(decoder.decode(payload.data(), payload.size() - 1, decoded.data(), decoded.size()));
+		}
+		ASSERT_FALSE(decoder.read_tables(tables.data(), tables.size() - 1));
+
+		if (test == text) // order-1 pays for its tables here
+		{
+			HuffmanEncoder order0(CANONICAL_CODES);
+			order0.append(data, test.size());
+			order0.append(data, 0);
+			vector<byte> order0_payload;
+			order0.encode(data, test.size(), order0_payload);
+			ASSERT_LT(tables.size() + payload.size(), (order0_payload.size() + 4 + ALPHABET) * 3 / 4);
+		}
+		if (test == noise) // nothing to gain, one shared table
+		{
+			ASSERT_EQ(2 + ALPHABET + CONTEXT_TABLE_SIZE, tables.size());
+		}
+	}
+}
+
+TEST(encode_decode, length_limit)
+{
+	// fibonacci frequencies: unlimited codes reach 24 bits
+	const vector<byte> test = fibonacci(25);
+	uint64_t freqs[ALPHABET] = {};
+	for (const auto symb : test)
+		++freqs[symb];
+
+	uint64_t unlimited = 0, previous = 0;
+	for (const size_t limit : {64, 15, 12, 11, 8, 5})
+	{
+		HuffmanEncoder encoder(CANONICAL_CODES, limit);
+		encoder.append(test.data(), test.size());
+		encoder.append(test.data(), 0);
+		byte* table;
+		size_t table_size;
+		encoder.write_tree(table, table_size);
+		uint64_t bits = 0;
+		for (size_t s = 0; s < ALPHABET; ++s)
+		{
+			ASSERT_LE(table[4 + s], limit);
+			bits += freqs[s] * table[4 + s];
+		}
+		ASSERT_TRUE(valid_code_lengths(table + 4));
+		if (limit == 64)
+		{
+			ASSERT_EQ(24, *std::max_element(table + 4, table + table_size));
+			unlimited = bits;
+		}
+		ASSERT_EQ(unlimited + encoder.limit_loss(), bits);
+		ASSERT_GE(bits, previous); // tighter limits never code shorter
+		previous = bits;
+
+		vector<byte> payload, tail, decoded;
+		encoder.encode(test.data(), test.size(), payload);
+		encoder.encode(test.data(), 0, tail);
+		payload.insert(payload.end(), tail.begin(), tail.end());
+		HuffmanDecoder decoder;
+		decoder.append(table, table_size);
+		decoder.append(table, 0);
+		decoder.decode(payload.data(), payload.size(), decoded);
+		decoded.resize(test.size());
+		ASSERT_EQ(test, decoded);
+		delete[] table;
+	}
+
+	// package-merge against hand-computed optimal lengths
+	uint64_t small[ALPHABET] = {};
+	small['a'] = 1, small['b'] = 1, small['c'] = 2, small['d'] = 4, small['e'] = 8;
+	byte lengths[ALPHABET];
+	limit_code_lengths(small, 3, lengths);
+	ASSERT_EQ(3, lengths['a']);
+	ASSERT_EQ(3, lengths['b']);
+	ASSERT_EQ(3, lengths['c']);
+	ASSERT_EQ(3, lengths['d']);
+	ASSERT_EQ(1, lengths['e']);
+	ASSERT_EQ(0, lengths['f']);
+}
+
+TEST(encode_decode, canonical)
+{
+	string tests[] = {"", "a", "aaaaaaaaaa", "ab", "abcdefghijklmnopqrstuvwxyz", "abracadabra"};
+	for (auto& test : tests)
+	{
+		string decode = run_encode_decode(test, CANONICAL_CODES);
+		ASSERT_EQ(test, decode);
+	}
+	for (size_t i = 0; i < 5; i++)
+	{
+		string test;
+		for (size_t j = 0; j < 500; j++)
+			test.push_back(static_cast<char>(rand() % (j % 7 == 0 ? 255 : 10)));
+		string decode = run_encode_decode(test, CANONICAL_CODES);
+		ASSERT_EQ(test, decode);
+		ASSERT_EQ(4 + ALPHABET, huf_size);
+	}
+}
+
+
 void check(const string& input_decode)
 {
 	std::ifstream fin(filename_input.c_str(), std::ios_base::binary);
@@ -378,3 +757,549 @@ TEST(encode_decode, file_big_input)
 	decompress(filename_output, input_decode, filename_hf);
 	check(input_decode);
 }
+
+string read_file(const string& filename)
+{
+	std::ifstream fin(filename.c_str(), std::ios_base::binary);
+	std::ostringstream content;
+	content << fin.rdbuf();
+	return content.str();
+}
+
+void write_file(const string& filename, const string& content)
+{
+	std::ofstream fout(filename.c_str(), std::ios_base::binary);
+	fout.write(content.data(), content.size());
+}
+
+TEST(archive, round_trip)
+{
+	const string filename_archive = "archive.huf", filename_decoded = "archive.out";
+	archive_options options;
+	options.block_size = 1000;
+	const size_t sizes[] = {0, 1, 999, 1000, 1001, 12345};
+	for (const auto size : sizes)
+	{
+		string test;
+		for (size_t i = 0; i < size; ++i)
+			test.push_back(static_cast<char>(i % 13 == 0 ? rand() % 256 : 'a' + rand() % 5));
+		write_file(filename_input, test);
+		for (const block_type type : {HUFFMAN4_BLOCK, CONTEXT_BLOCK, HUFFMAN_BLOCK})
+		{
+			options.interleaved = type == HUFFMAN4_BLOCK;
+			options.context = type == CONTEXT_BLOCK;
+			for (const bool mapped : {false, true})
+			{
+				options.mapped = mapped;
+				compress_file(filename_input, filename_archive, options);
+				decompress_file(filename_archive, filename_decoded, options);
+				ASSERT_EQ(test, read_file(filename_decoded));
+			}
+		}
+
+		std::ifstream fin(filename_archive.c_str(), std::ios_base::binary);
+		const vector<block_info> index = read_index(fin);
+		const string archive = read_file(filename_archive);
+		ASSERT_EQ(index.size(), read_index(reinterpret_cast<const byte*>(archive.data()), archive.size()).size());
+		ASSERT_EQ((size + options.block_size - 1) / options.block_size, index.size());
+		uint64_t total = 0;
+		for (size_t i = 0; i < index.size(); ++i)
+		{
+			fin.seekg(index[i].offset);
+			ASSERT_EQ(index[i].raw_size > 500 ? HUFFMAN_BLOCK : STORED_BLOCK, fin.get()); // short tails do not pay for a table
+			total += index[i].raw_size;
+		}
+		ASSERT_EQ(size, total);
+	}
+}
+
+TEST(archive, stored)
+{
+	archive_options options;
+	options.block_size = 4096;
+	string test;
+	for (size_t i = 0; i < 5 * options.block_size; ++i) // noise, text, noise...
+		test.push_back(static_cast<char>(i / options.block_size % 2 ? 'a' + rand() % 4 : rand() % 256));
+	write_file(filename_input, test);
+	for (const bool context : {false, true})
+	{
+		options.context = context;
+		compress_file(filename_input, "archive.huf", options);
+		decompress_file("archive.huf", "archive.out", options);
+		ASSERT_EQ(test, read_file("archive.out"));
+
+		std::ifstream fin("archive.huf", std::ios_base::binary);
+		const vector<block_info> index = read_index(fin);
+		ASSERT_EQ(5u, index.size());
+		for (size_t i = 0; i < index.size(); ++i)
+		{
+			fin.seekg(index[i].offset);
+			ASSERT_EQ(i % 2 ? (context ? CONTEXT_BLOCK : HUFFMAN_BLOCK) : STORED_BLOCK, fin.get());
+		}
+	}
+
+	// a stored block must hold exactly its raw bytes
+	block_header header = {STORED_BLOCK, 10, 0, 9};
+	byte packed[10] = {};
+	byte output[10];
+	ASSERT_THROW(decode_block(header, packed, output), HuffException);
+	header.payload_size = 10;
+	decode_block(header, packed, output);
+}
+
+TEST(archive, legacy_input)
+{
+	generate(64);
+	compress(filename_input, filename_output, filename_hf);
+	decompress_file(filename_output, "legacy.out", archive_options(), filename_hf);
+	ASSERT_EQ(read_file(filename_input), read_file("legacy.out"));
+
+	// canonical code lengths that are no prefix code, too long, or cut short
+	byte tag[4];
+	size_t end = 0;
+	write_int_to_byte_array(tag, CANONICAL_TAG, end);
+	string table(reinterpret_cast<const char*>(tag), sizeof tag);
+	table.resize(4 + ALPHABET, 0);
+	string tables[] = {table, table, table.substr(0, table.size() - 1)};
+	tables[0][4] = tables[0][5] = tables[0][6] = 1;
+	tables[1][4 + 'a'] = static_cast<char>(200);
+	tables[2][4] = 1;
+	for (const auto& bad : tables)
+	{
+		write_file(filename_hf, bad);
+		ASSERT_THROW(decompress_file(filename_output, "legacy.out", archive_options(), filename_hf), HuffException);
+	}
+
+	// a tree header whose path goes down again after leaving the root
+	byte tree[4 + 2 + 4 + 1];
+	end = 0;
+	write_int_to_byte_array(tree, 2, end);
+	tree[end++] = 'a';
+	tree[end++] = 'b';
+	write_int_to_byte_array(tree, 1, end);
+	tree[end++] = 0x40; // up from the root, then down
+	write_file(filename_hf, string(reinterpret_cast<const char*>(tree), end));
+	ASSERT_THROW(decompress_file(filename_output, "legacy.out", archive_options(), filename_hf), HuffException);
+
+	// a tree header with more nodes than any tree has
+	end = 0;
+	write_int_to_byte_array(tree, 2, end);
+	tree[end++] = 'a';
+	tree[end++] = 'b';
+	write_int_to_byte_array(tree, 100, end);
+	write_file(filename_hf, string(reinterpret_cast<const char*>(tree), end) + string(100, '\xff'));
+	ASSERT_THROW(decompress_file(filename_output, "legacy.out", archive_options(), filename_hf), HuffException);
+
+	// a payload that claims more symbols than it holds
+	compress(filename_input, filename_output, filename_hf);
+	string payload = read_file(filename_output);
+	byte size_field[8];
+	end = 0;
+	write_le64(size_field, read_file(filename_input).size() + 1, end);
+	payload.replace(0, sizeof size_field, reinterpret_cast<const char*>(size_field), sizeof size_field);
+	write_file(filename_output, payload);
+	ASSERT_THROW(decompress_file(filename_output, "legacy.out", archive_options(), filename_hf), HuffException);
+}
+
+TEST(archive, corrupted)
+{
+	const string filename_archive = "archive.huf";
+	write_file(filename_input, string(5000, 'x') + "yz");
+	compress_file(filename_input, filename_archive);
+	string archive = read_file(filename_archive);
+	size_t table = ARCHIVE_HEADER_SIZE;
+	read_block_header(reinterpret_cast<const byte*>(archive.data()), archive.size(), table);
+	table += CHECKSUM_SIZE;
+	archive_options options;
+	for (const bool mapped : {false, true})
+	{
+		options.mapped = mapped;
+		for (const bool verify : {false, true})
+		{
+			options.verify = verify;
+			write_file(filename_archive, archive.substr(0, archive.size() / 2));
+			ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+			string broken = archive;
+			broken[table + 4 + 'x'] = 100; // code length
+			write_file(filename_archive, broken);
+			ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+		}
+
+		// a flipped payload bit still decodes, only the checksum tells
+		string broken = archive;
+		broken[table + 4 + ALPHABET + 100] ^= 0x40;
+		write_file(filename_archive, broken);
+		options.verify = false;
+		decompress_file(filename_archive, "archive.out", options);
+		ASSERT_NE(read_file(filename_input), read_file("archive.out"));
+		options.verify = true;
+		ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+		broken = archive;
+		broken[table - 1] ^= 1; // the checksum itself
+		write_file(filename_archive, broken);
+		ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+		broken = archive;
+		broken[MAGIC_SIZE + 2 + 6] = 4; // blocks of 2^50 bytes
+		write_file(filename_archive, broken);
+		ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+		broken = archive;
+		broken[ARCHIVE_HEADER_SIZE] = static_cast<char>(180); // block type
+		write_file(filename_archive, broken);
+		ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+	}
+
+	// a block claiming 8 GiB of payload fails on the missing bytes, before that memory is taken
+	byte claim[ARCHIVE_HEADER_SIZE + MAX_BLOCK_HEADER_SIZE];
+	memcpy(claim, archive.data(), ARCHIVE_HEADER_SIZE);
+	size_t end = MAGIC_SIZE + 2;
+	write_le64(claim, MAX_BLOCK_SIZE, end);
+	const block_header block = {HUFFMAN_BLOCK, MAX_BLOCK_SIZE, 4 + ALPHABET, 8 * static_cast<uint64_t>(MAX_BLOCK_SIZE)};
+	write_block_header(claim, block, end);
+	write_file(filename_archive, string(reinterpret_cast<const char*>(claim), end) + string(100, 'x'));
+	options.mapped = false;
+	ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+
+	// index entries of no packed bytes cannot claim output, the output file is not even created
+	for (const uint64_t raw_size : {static_cast<uint64_t>(0), static_cast<uint64_t>(MAX_BLOCK_SIZE)})
+	{
+		byte empty[ARCHIVE_HEADER_SIZE + 2 + 100 * 2 * MAX_VARINT_SIZE + TRAILER_SIZE];
+		memcpy(empty, archive.data(), ARCHIVE_HEADER_SIZE);
+		end = ARCHIVE_HEADER_SIZE;
+		empty[end++] = END_BLOCK;
+		write_varint(empty, 100, end);
+		for (size_t i = 0; i < 100; ++i)
+		{
+			write_varint(empty, 0, end);
+			write_varint(empty, raw_size, end);
+		}
+		write_le64(empty, ARCHIVE_HEADER_SIZE, end);
+		memcpy(empty + end, ARCHIVE_MAGIC, MAGIC_SIZE);
+		end += MAGIC_SIZE;
+		if (raw_size == 0)
+		{
+			ASSERT_EQ(100u, read_index(empty, end).size());
+			continue;
+		}
+		ASSERT_THROW(read_index(empty, end), HuffException);
+		write_file(filename_archive, string(reinterpret_cast<const char*>(empty), end));
+		std::remove("archive.out");
+		options.mapped = true;
+		ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+		ASSERT_FALSE(std::ifstream("archive.out").is_open());
+	}
+	options.block_size = MAX_BLOCK_SIZE + 1;
+	ASSERT_THROW(compress_file(filename_input, filename_archive, options), std::invalid_argument);
+}
+
+TEST(archive, range)
+{
+	const string filename_archive = "archive.huf";
+	string test;
+	for (size_t i = 0; i < 10000; ++i)
+		test.push_back(static_cast<char>('a' + rand() % (i % 7 + 1)));
+	write_file(filename_input, test);
+	archive_options options;
+	options.block_size = 1000;
+	for (const bool checksums : {false, true})
+	{
+		options.checksums = checksums;
+		compress_file(filename_input, filename_archive, options);
+		const uint64_t ranges[][2] = {{0, 0}, {0, 1}, {0, 10000}, {0, UINT64_MAX}, {999, 2}, {1000, 1000},
+		                              {1500, 3333}, {9999, 5}, {10000, 1}, {20000, 1}, {5, UINT64_MAX}};
+		for (const auto& range : ranges)
+		{
+			std::ostringstream out;
+			decompress_range(filename_archive, out, range[0], range[1], options);
+			const size_t offset = std::min<uint64_t>(range[0], test.size());
+			ASSERT_EQ(test.substr(offset, std::min<uint64_t>(range[1], test.size() - offset)), out.str());
+		}
+	}
+	std::ostringstream out;
+	ASSERT_THROW(decompress_range(filename_input, out, 0, 1), HuffException); // not an archive
+}
+
+TEST(archive, varint)
+{
+	const uint64_t values[] = {0, 1, 127, 128, 300, UINT32_MAX, static_cast<uint64_t>(1) << 63, UINT64_MAX};
+	for (const auto value : values)
+	{
+		byte x[MAX_VARINT_SIZE];
+		size_t size = 0;
+		write_varint(x, value, size);
+		size_t end = 0;
+		uint64_t read = 0;
+		ASSERT_TRUE(read_varint(x, size, end, read));
+		ASSERT_EQ(value, read);
+		ASSERT_EQ(size, end);
+		end = 0;
+		ASSERT_FALSE(read_varint(x, size - 1, end, read));
+	}
+	const byte too_long[MAX_VARINT_SIZE] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x02};
+	size_t end = 0;
+	uint64_t read = 0;
+	ASSERT_FALSE(read_varint(too_long, MAX_VARINT_SIZE, end, read));
+
+	// a small block takes a few header bytes
+	block_header header;
+	header.type = HUFFMAN_BLOCK;
+	header.raw_size = 100;
+	header.table_size = 4 + ALPHABET;
+	header.payload_size = 60;
+	byte x[MAX_BLOCK_HEADER_SIZE];
+	write_block_header(x, header, end);
+	ASSERT_EQ(5u, end);
+}
+
+TEST(archive, version1)
+{
+	// archives with LE64 sizes, written before the varints, still decode
+	const string test = "an archive of version one, an archive of version one";
+	vector<byte> block;
+	encode_block(reinterpret_cast<const byte*>(test.data()), test.size(), block);
+	size_t end = 0;
+	const block_header header = read_block_header(block.data(), block.size(), end);
+	const byte* packed = block.data() + end + CHECKSUM_SIZE;
+
+	vector<byte> archive(ARCHIVE_HEADER_SIZE + 1 + 3 * 8 + CHECKSUM_SIZE);
+	memcpy(archive.data(), ARCHIVE_MAGIC, MAGIC_SIZE);
+	end = MAGIC_SIZE;
+	archive[end++] = 1;
+	archive[end++] = CHECKSUM_FLAG;
+	write_le64(archive.data(), BLOCK_SIZE, end);
+	write_block_header(archive.data(), header, end, 1);
+	const uint32_t crc = crc32c(packed, header.packed_size(),
+	                            crc32c(archive.data() + ARCHIVE_HEADER_SIZE, end - ARCHIVE_HEADER_SIZE));
+	for (size_t i = 0; i < CHECKSUM_SIZE; ++i)
+		archive[end++] = static_cast<byte>(crc >> (8 * i));
+	archive.insert(archive.end(), packed, packed + header.packed_size());
+	const uint64_t index_offset = archive.size();
+	archive.resize(index_offset + 1 + 3 * 8 + TRAILER_SIZE);
+	end = index_offset;
+	archive[end++] = END_BLOCK;
+	write_le64(archive.data(), 1, end);
+	write_le64(archive.data(), ARCHIVE_HEADER_SIZE, end);
+	write_le64(archive.data(), test.size(), end);
+	write_le64(archive.data(), index_offset, end);
+	memcpy(archive.data() + end, ARCHIVE_MAGIC, MAGIC_SIZE);
+
+	const string filename_archive = "archive.huf";
+	write_file(filename_archive, string(archive.begin(), archive.end()));
+	archive_options options;
+	for (const bool mapped : {false, true})
+	{
+		options.mapped = mapped;
+		decompress_file(filename_archive, "archive.out", options);
+		ASSERT_EQ(test, read_file("archive.out"));
+	}
+	std::ostringstream out;
+	decompress_range(filename_archive, out, 9, 12);
+	ASSERT_EQ(test.substr(9, 12), out.str());
+
+	// 100 entries at the same offset claim 100 GiB from 1635 bytes, the output file is not even created
+	vector<byte> claim(ARCHIVE_HEADER_SIZE + 1 + 8 + 100 * 2 * 8 + TRAILER_SIZE);
+	memcpy(claim.data(), archive.data(), MAGIC_SIZE + 2);
+	end = MAGIC_SIZE + 2;
+	write_le64(claim.data(), MAX_BLOCK_SIZE, end);
+	claim[end++] = END_BLOCK;
+	write_le64(claim.data(), 100, end);
+	for (size_t i = 0; i < 100; ++i)
+	{
+		write_le64(claim.data(), ARCHIVE_HEADER_SIZE, end);
+		write_le64(claim.data(), MAX_BLOCK_SIZE, end);
+	}
+	write_le64(claim.data(), ARCHIVE_HEADER_SIZE, end);
+	memcpy(claim.data() + end, ARCHIVE_MAGIC, MAGIC_SIZE);
+	ASSERT_THROW(read_index(claim.data(), claim.size()), HuffException);
+	write_file(filename_archive, string(claim.begin(), claim.end()));
+	std::remove("archive.out");
+	options.mapped = true;
+	ASSERT_THROW(decompress_file(filename_archive, "archive.out", options), HuffException);
+	ASSERT_FALSE(std::ifstream("archive.out").is_open());
+}
+
+TEST(archive, crc32c)
+{
+	const string check = "123456789";
+	const byte* data = reinterpret_cast<const byte*>(check.data());
+	ASSERT_EQ(0xe3069283, crc32c(data, check.size()));
+	ASSERT_EQ(0xe3069283, crc32c_portable(data, check.size()));
+	vector<byte> test(1000);
+	for (auto& x : test)
+		x = static_cast<byte>(rand());
+	for (size_t size = 0; size <= test.size(); size += 37)
+	{
+		const uint32_t crc = crc32c(test.data(), size);
+		ASSERT_EQ(crc32c_portable(test.data(), size), crc);
+		ASSERT_EQ(crc, crc32c(test.data() + size / 2, size - size / 2, crc32c(test.data(), size / 2)));
+	}
+}
+
+TEST(archive, threads)
+{
+	string test;
+	for (size_t i = 0; i < 200000; ++i)
+		test.push_back(static_cast<char>(rand() % (i / 10000 + 2)));
+	write_file(filename_input, test);
+	archive_options options;
+	options.block_size = 4096;
+	compress_file(filename_input, "archive1.huf", options);
+	options.threads = 4;
+	compress_file(filename_input, "archive4.huf", options);
+	ASSERT_EQ(read_file("archive1.huf"), read_file("archive4.huf"));
+	decompress_file("archive4.huf", "archive.out", options);
+	ASSERT_EQ(test, read_file("archive.out"));
+	options.memory = 1; // one block at a time
+	decompress_file("archive4.huf", "archive.out", options);
+	ASSERT_EQ(test, read_file("archive.out"));
+}
+
+TEST(archive, streams)
+{
+	string test;
+	for (size_t i = 0; i < 50000; ++i)
+		test.push_back(static_cast<char>('a' + rand() % (i % 3 + 1)));
+	archive_options options;
+	options.block_size = 4000;
+	options.threads = 2;
+	std::istringstream in(test);
+	std::ostringstream packed;
+	compress_stream(in, packed, options);
+
+	write_file(filename_input, test);
+	compress_file(filename_input, "archive.huf", options);
+	ASSERT_EQ(read_file("archive.huf"), packed.str());
+
+	std::istringstream archive(packed.str());
+	std::ostringstream decoded;
+	decompress_stream(archive, decoded, options);
+	ASSERT_EQ(test, decoded.str());
+
+	std::istringstream truncated(packed.str().substr(0, packed.str().size() / 2));
+	ASSERT_THROW(decompress_stream(truncated, decoded, options), HuffException);
+
+	// the index and the trailer are checked as on the mapped path
+	size_t end = packed.str().size() - TRAILER_SIZE;
+	const uint64_t index_offset = read_le64(reinterpret_cast<const byte*>(packed.str().data()), end);
+	std::istringstream no_index(packed.str().substr(0, index_offset + 1)); // cut after END_BLOCK
+	ASSERT_THROW(decompress_stream(no_index, decoded, options), HuffException);
+	std::istringstream garbage(packed.str() + "xyz");
+	ASSERT_THROW(decompress_stream(garbage, decoded, options), HuffException);
+}
+
+// counts the flushes a tied input stream would do from the reading thread
+class sync_counting_buf : public std::stringbuf
+{
+public:
+	size_t syncs = 0;
+
+protected:
+	int sync() override
+	{
+		++syncs;
+		return std::stringbuf::sync();
+	}
+};
+
+TEST(archive, tied_streams)
+{
+	string test;
+	for (size_t i = 0; i < 20000; ++i)
+		test.push_back(static_cast<char>('a' + rand() % (i % 5 + 1)));
+	archive_options options;
+	options.block_size = 100;
+	options.threads = 2;
+
+	// as std::cin and std::cout are: the writer thread owns out, the reads must not flush it
+	sync_counting_buf packed_buf;
+	std::ostream packed(&packed_buf);
+	std::istringstream in(test);
+	in.tie(&packed);
+	compress_stream(in, packed, options);
+	ASSERT_EQ(&packed, in.tie());
+	ASSERT_EQ(0u, packed_buf.syncs);
+
+	sync_counting_buf decoded_buf;
+	std::ostream decoded(&decoded_buf);
+	std::istringstream archive(packed_buf.str());
+	archive.tie(&decoded);
+	decompress_stream(archive, decoded, options);
+	ASSERT_EQ(&decoded, archive.tie());
+	ASSERT_EQ(0u, decoded_buf.syncs);
+	ASSERT_EQ(test, decoded_buf.str());
+}
+
+TEST(archive, pipeline)
+{
+	string test;
+	for (size_t i = 0; i < 300000; ++i)
+		test.push_back(static_cast<char>('a' + rand() % (i / 20000 + 2)));
+	archive_options options;
+	options.block_size = 1000; // many more blocks than the rings hold
+	options.threads = 3;
+	options.memory = 3000;
+	std::istringstream in(test);
+	std::ostringstream packed;
+	compress_stream(in, packed, options);
+	std::istringstream archive(packed.str());
+	std::ostringstream decoded;
+	decompress_stream(archive, decoded, options);
+	ASSERT_EQ(test, decoded.str());
+
+	// a bad block in the middle fails the whole stream instead of hanging the stages
+	string corrupted = packed.str();
+	corrupted[corrupted.size() / 2] ^= 0x55;
+	std::istringstream bad(corrupted);
+	std::ostringstream rest;
+	ASSERT_THROW(decompress_stream(bad, rest, options), HuffException);
+	ASSERT_LT(rest.str().size(), test.size());
+}
+
+TEST(dictionary, round_trip)
+{
+	vector<string> samples;
+	for (size_t k = 0; k < 3; ++k)
+	{
+		string sample;
+		for (size_t i = 0; i < 5000; ++i)
+			sample += "{\"id\": " + std::to_string(rand() % 1000) + ", \"ok\": true}\n";
+		samples.push_back("sample" + std::to_string(k) + ".json");
+		write_file(samples.back(), sample);
+	}
+	save_dictionary(train_dictionary(samples, 12), "samples.hud");
+	const HuffDictionary dictionary = load_dictionary("samples.hud");
+
+	const string small = "{\"id\": 42, \"ok\": true}\n{\"id\": 7, \"ok\": true}\n";
+	vector<byte> packed;
+	dictionary.encode(reinterpret_cast<const byte*>(small.data()), small.size(), packed);
+	ASSERT_LT(packed.size(), small.size()); // no table to pay for
+	vector<byte> decoded;
+	dictionary.decode(packed.data(), packed.size(), decoded);
+	ASSERT_EQ(small, string(decoded.begin(), decoded.end()));
+
+	vector<string> files, contents;
+	for (size_t k = 0; k < 20; ++k)
+	{
+		string test = k % 2 ? small : "";
+		for (size_t i = 0; i < k * 100; ++i)
+			test.push_back(static_cast<char>(rand() % 256)); // bytes the samples lack
+		files.push_back("small" + std::to_string(k) + ".json");
+		contents.push_back(test);
+		write_file(files.back(), test);
+	}
+	compress_files(dictionary, files, 4);
+	vector<string> coded;
+	for (const auto& file : files)
+		coded.push_back(file + CODED_SUFFIX);
+	for (const auto& file : files)
+		write_file(file, "");
+	decompress_files(dictionary, coded, 4);
+	for (size_t k = 0; k < files.size(); ++k)
+		ASSERT_EQ(contents[k], read_file(files[k]));
+
+	// another dictionary does not decode it
+	uint64_t counts[ALPHABET] = {};
+	counts['a'] = 1;
+	const HuffDictionary other(counts);
+	ASSERT_THROW(other.decode(packed.data(), packed.size(), decoded), HuffException);
+	ASSERT_THROW(dictionary.decode(packed.data(), packed.size() / 2, decoded), HuffException);
+}